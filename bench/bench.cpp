@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../include/utils.hpp"
+#include "../include/agents.hpp"
+#include "../include/runtime_config.hpp"
+#include "../include/simulation.hpp"
+
+/**
+ * @brief The timing of one benchmark at one point of the sweep
+ */
+struct BenchResult
+{
+    std::string name;
+    int population, hidden;
+    long iterations;
+    double ns_per_iteration;
+};
+
+/**
+ * @brief Time a piece of work by running it until at least min_seconds have passed, after one untimed warm up run.
+ *
+ * @param name The benchmark's name
+ * @param population The population size it was run with, 1 for single network benchmarks
+ * @param hidden The hidden layer width it was run with
+ * @param min_seconds How long to keep repeating the work for
+ * @param work The work to time
+ * @return BenchResult
+ */
+template <typename Function>
+BenchResult measure(const std::string &name, int population, int hidden, double min_seconds, Function work)
+{
+    typedef std::chrono::steady_clock Clock;
+    work();
+
+    long iterations = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0;
+    // Check the clock in growing batches so cheap work is not dominated by reading it
+    for (long batch = 1; elapsed < min_seconds; batch *= 2)
+    {
+        for (long i = 0; i < batch; i++)
+            work();
+        iterations += batch;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    BenchResult result = {name, population, hidden, iterations, elapsed * 1e9 / iterations};
+    std::cerr << name << " population=" << population << " hidden=" << hidden << ": " << result.ns_per_iteration << " ns" << std::endl;
+    return result;
+}
+
+/**
+ * @brief The configured hidden layers with every one of them resized to the width being benchmarked
+ *
+ * @param hidden The hidden layer width
+ * @return std::vector<LayerShape>
+ */
+std::vector<LayerShape> hidden_layers_of_width(int hidden)
+{
+    std::vector<LayerShape> shapes = config.hidden_layers;
+    for (LayerShape &shape : shapes)
+        shape.num_neurons = hidden;
+    return shapes;
+}
+
+/**
+ * @brief Benchmarks that work on a single Layer or Neural Network
+ *
+ * @param hidden The hidden layer width
+ * @param min_seconds How long to time each benchmark for
+ * @param results Where to add the results
+ */
+void bench_network(int hidden, double min_seconds, std::vector<BenchResult> &results)
+{
+    std::vector<LayerShape> shapes = hidden_layers_of_width(hidden);
+    NeuralNetwork a(2, 4, shapes), b(2, 4, shapes), child(2, 4, shapes);
+    float inputs[2] = {0.25, -0.5};
+    std::vector<float> scratch(std::max(child.scratch_size(), hidden)), outputs(4);
+
+    results.push_back(measure("layer_calculate_outputs", 1, hidden, min_seconds, [&]
+                              { child.layers[0]->calculate_outputs(inputs, scratch.data()); }));
+    results.push_back(measure("neural_network_predict", 1, hidden, min_seconds, [&]
+                              { child.predict(inputs, outputs.data(), scratch.data()); }));
+
+    const char *merge_names[] = {"merge_every_other", "merge_single_split", "merge_random_choice"};
+    MergeType merge_types[] = {EveryOther, SingleSplit, RandomChoice};
+    for (int merge = 0; merge < 3; merge++)
+        results.push_back(measure(merge_names[merge], 1, hidden, min_seconds, [&]
+                                  { child.merge(&a, &b, merge_types[merge]); }));
+
+    results.push_back(measure("layer_mutate", 1, hidden, min_seconds, [&]
+                              { child.layers[0]->mutate(0.05); }));
+}
+
+/**
+ * @brief Benchmarks that work on a whole population
+ *
+ * @param population The number of agents
+ * @param hidden The hidden layer width
+ * @param min_seconds How long to time each benchmark for
+ * @param pool The threads to simulate with
+ * @param results Where to add the results
+ */
+void bench_population(int population, int hidden, double min_seconds, ThreadPool &pool, std::vector<BenchResult> &results)
+{
+    Position start(100, 100), goal(600, 500);
+    std::vector<Scenario> scenarios = make_scenarios(start, goal, config.num_scenarios, config.boundary_edge_length, config.num_obstacles, config.obstacle_radius, config.draw_object_size);
+    std::vector<Agent *> agents, next;
+    std::vector<LayerShape> shapes = hidden_layers_of_width(hidden);
+    for (int agent_i = 0; agent_i < population; agent_i++)
+    {
+        agents.push_back(new Agent(start, config.num_sensors(), EndpointsOnly, shapes));
+        next.push_back(new Agent(start, config.num_sensors(), EndpointsOnly, shapes));
+    }
+    PopulationNetwork network;
+    std::vector<AgentDistancePair> closest;
+    closest.reserve(population);
+    int num_selected = std::min(config.num_agents_selected_each_generation, population);
+
+    results.push_back(measure("run_sim", population, hidden, min_seconds, [&]
+                              {
+        setup_agent_generation(agents, &start, NULL, config.merge_strategy, 0, EndpointsOnly, generator, &pool);
+        run_sim(agents, scenarios, network, pool); }));
+
+    // One full generation: breed from the last one's selection, simulate, then rank
+    get_closest_agents(agents, scenarios, closest, num_selected, config.fitness_reduction);
+    int generation = 0;
+    results.push_back(measure("generation", population, hidden, min_seconds, [&]
+                              {
+        setup_agent_generation(next, &start, &closest, config.merge_strategy, 0.05, EndpointsOnly, generator.split(generation++), &pool);
+        std::swap(agents, next);
+        run_sim(agents, scenarios, network, pool);
+        get_closest_agents(agents, scenarios, closest, num_selected, config.fitness_reduction); }));
+
+    for (int agent_i = 0; agent_i < population; agent_i++)
+    {
+        delete agents[agent_i];
+        delete next[agent_i];
+    }
+}
+
+void write_csv(std::ostream &out, std::vector<BenchResult> &results)
+{
+    out << "benchmark,population,hidden,iterations,ns_per_iteration" << std::endl;
+    for (BenchResult &result : results)
+        out << result.name << "," << result.population << "," << result.hidden << "," << result.iterations << "," << result.ns_per_iteration << std::endl;
+}
+
+void write_json(std::ostream &out, std::vector<BenchResult> &results)
+{
+    const char *simd_names[] = {"scalar", "sse", "avx2", "avx512"};
+    const char *precision_names[] = {"float32", "float16", "int8"};
+    out << "{" << std::endl
+        << "  \"simd\": \"" << simd_names[simd.level] << "\"," << std::endl
+        << "  \"threads\": " << config.num_threads << "," << std::endl
+        << "  \"ticks_per_generation\": " << config.num_ticks_per_gen << "," << std::endl
+        << "  \"scenarios\": " << config.num_scenarios << "," << std::endl
+        << "  \"weight_precision\": \"" << precision_names[config.weight_precision] << "\"," << std::endl
+        << "  \"results\": [" << std::endl;
+    for (size_t result_i = 0; result_i < results.size(); result_i++)
+    {
+        BenchResult &result = results[result_i];
+        out << "    {\"benchmark\": \"" << result.name << "\", \"population\": " << result.population << ", \"hidden\": " << result.hidden
+            << ", \"iterations\": " << result.iterations << ", \"ns_per_iteration\": " << result.ns_per_iteration << "}"
+            << (result_i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl
+        << "}" << std::endl;
+}
+
+/**
+ * @brief Parse a comma separated list of sizes
+ *
+ * @param text
+ * @param min_size The smallest size allowed
+ * @param sizes Set to the sizes
+ * @return true
+ * @return false A size was missing or smaller than min_size
+ */
+bool parse_sizes(const std::string &text, int min_size, std::vector<int> &sizes)
+{
+    sizes.clear();
+    size_t begin = 0;
+    while (begin <= text.size())
+    {
+        size_t end = text.find(',', begin);
+        if (end == std::string::npos)
+            end = text.size();
+        int size = atoi(text.substr(begin, end - begin).c_str());
+        if (size < min_size)
+            return false;
+        sizes.push_back(size);
+        begin = end + 1;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    std::string format = "json", output_path;
+    double min_seconds = 0.2;
+    std::vector<int> populations = {10, 100, 1000}, hiddens = {4, 10, 32};
+
+    // Benchmark options are taken out here, everything else goes to the runtime config
+    config.num_threads = 1;
+    std::vector<char *> config_args = {argv[0]};
+    for (int arg_i = 1; arg_i < argc; arg_i++)
+    {
+        std::string arg = argv[arg_i];
+        if (arg.compare(0, 9, "--format=") == 0)
+            format = arg.substr(9);
+        else if (arg.compare(0, 9, "--output=") == 0)
+            output_path = arg.substr(9);
+        else if (arg.compare(0, 11, "--min_time=") == 0)
+            min_seconds = atof(arg.c_str() + 11);
+        else if (arg.compare(0, 14, "--populations=") == 0)
+        {
+            // Breeding never finishes picking two different parents from fewer than 3 agents, see 'setup_agent_range'
+            if (!parse_sizes(arg.substr(14), 3, populations))
+            {
+                std::cerr << "--populations expects a comma separated list of sizes of at least 3" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 10, "--hiddens=") == 0)
+        {
+            if (!parse_sizes(arg.substr(10), 1, hiddens))
+            {
+                std::cerr << "--hiddens expects a comma separated list of widths of at least 1" << std::endl;
+                return 1;
+            }
+        }
+        else
+            config_args.push_back(argv[arg_i]);
+    }
+    if (format != "json" && format != "csv")
+    {
+        std::cerr << "Unknown format " << format << ", expected json or csv" << std::endl;
+        return 1;
+    }
+    if (std::find(config_args.begin(), config_args.end(), std::string("--help")) != config_args.end())
+        std::cout << "Benchmark options: --format=json|csv --output=<file> --min_time=<seconds> --populations=10,100 --hiddens=4,10" << std::endl;
+    if (!config.parse_args(config_args.size(), config_args.data()))
+        return 1;
+
+    generator.seed(1);
+    ThreadPool pool(config.num_threads);
+    std::vector<BenchResult> results;
+    for (int hidden : hiddens)
+    {
+        bench_network(hidden, min_seconds, results);
+        for (int population : populations)
+            bench_population(population, hidden, min_seconds, pool, results);
+    }
+
+    std::ofstream file;
+    if (!output_path.empty())
+    {
+        file.open(output_path);
+        if (!file)
+        {
+            std::cerr << "Could not write " << output_path << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &out = output_path.empty() ? std::cout : file;
+    if (format == "csv")
+        write_csv(out, results);
+    else
+        write_json(out, results);
+    return 0;
+}
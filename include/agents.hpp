@@ -1,13 +1,44 @@
 #include "neural_network.hpp"
 #include "utils.hpp"
 #include "config.hpp"
-#include <SFML/Graphics.hpp>
+#include "runtime_config.hpp"
+#include "trajectory.hpp"
+#include "scenario.hpp"
+#include "fixed_neural_network.hpp"
 #include <cstdio>
 #include <iostream>
 
 #ifndef AGENT_H
 #define AGENT_H
 
+// The shape of the Agents created in main with the default sensors (the goal offset only), the default single hidden
+// layer and 4 controls, any other shape falls back to NeuralNetwork
+typedef FixedNeuralNetwork<2, 10, 4> AgentFixedNetwork;
+
+/**
+ * @brief Where an Agent is in one of its extra scenarios, everything but the first is only ever run to its endpoint
+ * so no path is kept, see 'Agent::check_settled' for how settling works.
+ */
+struct ScenarioRun
+{
+    Position pos;
+    CycleDetector cycle;
+    int num_steps, cycle_length, settle_at_step;
+    bool settled;
+
+    ScenarioRun() : pos(0, 0) {}
+
+    void reset(Position start)
+    {
+        pos = start;
+        cycle.reset(start);
+        num_steps = 0;
+        cycle_length = 0;
+        settle_at_step = -1;
+        settled = false;
+    }
+};
+
 /**
  * @brief Agents have brains and can be based on other Agents.
  *
@@ -15,24 +46,50 @@
 struct Agent
 {
 private:
+    /**
+     * @brief Size the per-Agent inference buffers once, so the forward pass never has to allocate.
+     */
+    void setup_scratch()
+    {
+        move_deltas.resize(num_controls);
+        hidden_scratch.resize(nn->scratch_size());
+    }
+
     /**
      * @brief Mutate the Neural Network of this Agent.
      *
      * @param mutation_chance The chance any given weight will be mutated.
+     * @param rng The generator to draw from
      */
-    void mutate(float mutation_chance)
+    void mutate(float mutation_chance, Rng &rng = generator)
     {
         if (mutation_chance == 0)
             return;
 
         // Mutate our NN
-        nn->mutate(mutation_chance);
+        nn->mutate(mutation_chance, rng);
     }
 
 public:
-    std::vector<Position *> positions;
+    Trajectory path;
+    // Used to stop simulating this Agent once it is stuck in a loop, see 'check_settled'
+    CycleDetector cycle;
+    int cycle_length, settle_at_step;
+    bool settled;
     NeuralNetwork *nn;
+    // Inference copy of nn, used by 'move' with use_fixed_topology_network when the shapes match
+    AgentFixedNetwork fixed_nn;
+    bool use_fixed_nn;
     int num_sensors, num_controls;
+    // The furthest an Agent can go in x or y, read from the config on reset so moving never has to
+    float max_position;
+    // Reused every tick so moving never allocates, see 'move'
+    std::vector<float> move_deltas, hidden_scratch;
+    // Scenarios 1 and up, scenario 0 is the path above
+    std::vector<ScenarioRun> scenario_runs;
+    // Distance from the goal in each scenario and their reduction, filled in by 'score'
+    std::vector<float> scenario_distances;
+    float fitness;
 
     /**
      * @brief Construct a new Agent object
@@ -41,12 +98,15 @@ public:
      *
      * @param pos The starting position for this Agent
      * @param num_sensors The number of sensors this agent will have, basically the number of inputs to our Neural Network
+     * @param retention How much of this Agent's path to keep, see 'trajectory_retention_for'
+     * @param hidden_layers The Neural Network's hidden layers in order from the inputs
      */
-    Agent(Position *pos, int num_sensors) : num_sensors(num_sensors)
+    Agent(Position pos, int num_sensors, TrajectoryRetention retention = EndpointsOnly, const std::vector<LayerShape> &hidden_layers = config.hidden_layers) : path(pos, retention, config.num_ticks_per_gen), num_sensors(num_sensors)
     {
         num_controls = 4; // X-Delta, Y-Delta, X-Positive, Y-Positive
-        nn = new NeuralNetwork(num_sensors, num_controls);
-        positions.push_back(pos);
+        nn = new NeuralNetwork(num_sensors, num_controls, hidden_layers);
+        setup_scratch();
+        reset(pos, retention);
     }
 
     /**
@@ -57,51 +117,238 @@ public:
      * @param ancestor2 Ancestor 2 for NN
      * @param mt The merge strategy for merging the two agents
      * @param mutation_chance Mutation chance for any given weight in the NN
+     * @param retention How much of this Agent's path to keep, see 'trajectory_retention_for'
      */
-    Agent(Position *pos, Agent *ancestor1, Agent *ancestor2, MergeType mt = SingleSplit, float mutation_chance = MAX_MUTATION_CHANCE) : num_controls(ancestor1->num_controls), num_sensors(ancestor1->num_sensors)
+    Agent(Position pos, Agent *ancestor1, Agent *ancestor2, MergeType mt = SingleSplit, float mutation_chance = config.max_mutation_chance, TrajectoryRetention retention = EndpointsOnly) : path(pos, retention, config.num_ticks_per_gen), num_sensors(ancestor1->num_sensors), num_controls(ancestor1->num_controls)
     {
         nn = new NeuralNetwork(ancestor1->nn, ancestor2->nn, mt);
-        positions.push_back(pos);
+        setup_scratch();
+        reset(pos, retention);
         mutate(mutation_chance);
     }
 
     ~Agent()
     {
-        for (int pos = 0; pos < positions.size(); pos++)
-            delete positions[pos];
         delete nn;
     }
 
+    /**
+     * @brief Turn this Agent into the child of two others, in place.
+     *
+     * The same as constructing a new Agent from two ancestors, but reuses this Agent's Neural Network and path storage
+     * so a population can be bred without any allocation.
+     *
+     * @param pos The start position for this Agent
+     * @param ancestor1 Ancestor 1 for NN
+     * @param ancestor2 Ancestor 2 for NN
+     * @param mt The merge strategy for merging the two agents
+     * @param mutation_chance Mutation chance for any given weight in the NN
+     * @param retention How much of this Agent's path to keep, see 'trajectory_retention_for'
+     * @param rng The generator to draw from, defaults to this thread's generator
+     */
+    void breed(Position pos, Agent *ancestor1, Agent *ancestor2, MergeType mt, float mutation_chance, TrajectoryRetention retention, Rng &rng = generator)
+    {
+        nn->merge(ancestor1->nn, ancestor2->nn, mt, rng);
+        mutate(mutation_chance, rng);
+        reset(pos, retention);
+    }
+
+    /**
+     * @brief Put this Agent back at the start, ready for a new generation
+     *
+     * @param pos The start position for this Agent
+     * @param retention How much of this Agent's path to keep, see 'trajectory_retention_for'
+     */
+    void reset(Position pos, TrajectoryRetention retention)
+    {
+        path.reset(pos, retention, config.num_ticks_per_gen);
+        max_position = config.boundary_edge_length - config.draw_object_size;
+        cycle.reset(pos);
+        // Every change to nn's weights (breeding, restoring) is followed by a reset
+        use_fixed_nn = config.use_fixed_topology_network && AgentFixedNetwork::matches(nn);
+        if (use_fixed_nn)
+            fixed_nn.load(nn);
+        cycle_length = 0;
+        settle_at_step = -1;
+        settled = false;
+    }
+
+    /**
+     * @brief Put this Agent at the start of every extra scenario, call after 'reset' when simulating more than one
+     *
+     * Only allocates the first time a number of scenarios is seen.
+     *
+     * @param scenarios Every scenario, the first one's start is the one given to 'reset'
+     */
+    void reset_scenarios(const std::vector<Scenario> &scenarios)
+    {
+        scenario_runs.resize(scenarios.size() - 1);
+        for (size_t scenario = 1; scenario < scenarios.size(); scenario++)
+            scenario_runs[scenario - 1].reset(scenarios[scenario].start);
+    }
+
+    /**
+     * @brief Get the current (or, once a run is over, final) position in a scenario
+     *
+     * @param scenario
+     * @return Position
+     */
+    Position scenario_position(int scenario) const
+    {
+        return scenario == 0 ? path.back() : scenario_runs[scenario - 1].pos;
+    }
+
+    /**
+     * @brief Whether a scenario no longer needs simulating
+     *
+     * @param scenario
+     * @return true
+     * @return false
+     */
+    bool scenario_settled(int scenario) const
+    {
+        return scenario == 0 ? settled : scenario_runs[scenario - 1].settled;
+    }
+
+    /**
+     * @brief Place this Agent at the end of a scenario that was simulated somewhere else
+     *
+     * @param scenario
+     * @param final_pos
+     */
+    void finish_scenario(int scenario, Position final_pos)
+    {
+        if (scenario == 0)
+            path.push(final_pos.x, final_pos.y);
+        else
+            scenario_runs[scenario - 1].pos = final_pos;
+    }
+
+    /**
+     * @brief Work out this Agent's fitness once every scenario has been run
+     *
+     * @param scenarios The scenarios that were run
+     * @param reduction How the distances are combined
+     * @return float The fitness, lower is better
+     */
+    float score(const std::vector<Scenario> &scenarios, FitnessReduction reduction)
+    {
+        scenario_distances.resize(scenarios.size());
+        for (size_t scenario = 0; scenario < scenarios.size(); scenario++)
+            scenario_distances[scenario] = get_distance(scenario_position(scenario), scenarios[scenario].goal);
+        fitness = reduce_fitness(scenario_distances.data(), scenarios.size(), reduction);
+        return fitness;
+    }
+
+    /**
+     * @brief Check whether this Agent can stop being simulated, call once after every move.
+     *
+     * An Agent's next move only depends on its position (the goal and obstacles never move, and it can't sense other
+     * Agents unless num_sensed_neighbours is set, which never uses this), so once it revisits a position it will
+     * repeat the same cycle for the rest of the run. When a cycle of length L is found with R steps left, the Agent
+     * only needs R % L more steps to land on its exact final position, after which the rest of its path is filled in
+     * from the cycle and it is marked as settled.
+     *
+     * @param total_steps The number of steps in a full run
+     * @param scenario Which scenario to check, every scenario after the first only keeps its final position
+     * @return true Once the Agent is settled and its path is complete
+     * @return false
+     */
+    bool check_settled(int total_steps, int scenario = 0)
+    {
+        if (scenario > 0)
+        {
+            ScenarioRun &run = scenario_runs[scenario - 1];
+            if (run.settle_at_step < 0)
+            {
+                run.cycle_length = run.cycle.observe(run.pos);
+                if (run.cycle_length == 0)
+                    return false;
+                run.settle_at_step = run.num_steps + (total_steps - run.num_steps) % run.cycle_length;
+            }
+            run.settled = run.num_steps >= run.settle_at_step;
+            return run.settled;
+        }
+
+        int steps = path.num_steps;
+        if (settle_at_step < 0)
+        {
+            cycle_length = cycle.observe(path.back());
+            if (cycle_length == 0)
+                return false;
+            settle_at_step = steps + (total_steps - steps) % cycle_length;
+        }
+        if (steps < settle_at_step)
+            return false;
+
+        path.extend_cycle(cycle_length, total_steps);
+        settled = true;
+        return true;
+    }
+
     /**
      * @brief Allow this agent to make its next move
      *
      * @param sensor_input The input for the Agent to base its decision off of
+     * @param scenario The scenario to move in
+     * @param world The scenario's obstacles, NULL when there are none
      */
-    void move(float *sensor_input)
+    void move(float *sensor_input, int scenario = 0, const Scenario *world = NULL)
     {
         // Get how much this agent wants to move
-        float *move_deltas = nn->predict(sensor_input);
+        if (use_fixed_nn)
+            fixed_nn.predict(sensor_input, move_deltas.data());
+        else
+            nn->predict(sensor_input, move_deltas.data(), hidden_scratch.data());
+
+        apply_move_deltas(move_deltas.data(), scenario, world);
+    }
 
+    /**
+     * @brief Turn the output of this Agent's Neural Network into its next position
+     *
+     * This is split out of 'move' so batched inference can run the Neural Networks of a whole population at once and
+     * then hand each Agent its own predictions.
+     *
+     * A move that would end inside an obstacle isn't made, the Agent stays where it is for that tick.
+     *
+     * @param move_deltas The Neural Network outputs, expected to be num_controls long
+     * @param scenario The scenario to move in
+     * @param world The scenario's obstacles, NULL when there are none
+     */
+    void apply_move_deltas(float *move_deltas, int scenario = 0, const Scenario *world = NULL)
+    {
         // Get and store its next position
-        Position *curr_pos = positions.back();
-        float next_pos_x = move_deltas[2] > 0.5 ? (curr_pos->x + move_deltas[0]) : (curr_pos->x - move_deltas[0]);
-        float next_pos_y = move_deltas[3] > 0.5 ? (curr_pos->y + move_deltas[1]) : (curr_pos->y - move_deltas[1]);
+        Position curr_pos = scenario_position(scenario);
+        float next_pos_x = move_deltas[2] > 0.5 ? (curr_pos.x + move_deltas[0]) : (curr_pos.x - move_deltas[0]);
+        float next_pos_y = move_deltas[3] > 0.5 ? (curr_pos.y + move_deltas[1]) : (curr_pos.y - move_deltas[1]);
 
         // Check for boundaries
         if (next_pos_x < 0)
             next_pos_x = 0;
-        if (next_pos_x > BOUNDARY_EDGE_LENGTH - DRAW_OBJECT_SIZE)
-            next_pos_x = BOUNDARY_EDGE_LENGTH - DRAW_OBJECT_SIZE;
+        if (next_pos_x > max_position)
+            next_pos_x = max_position;
         if (next_pos_y < 0)
             next_pos_y = 0;
-        if (next_pos_y > BOUNDARY_EDGE_LENGTH - DRAW_OBJECT_SIZE)
-            next_pos_y = BOUNDARY_EDGE_LENGTH - DRAW_OBJECT_SIZE;
+        if (next_pos_y > max_position)
+            next_pos_y = max_position;
 
-        // Store location
-        positions.push_back(new Position(next_pos_x, next_pos_y));
+        // Check for obstacles
+        if (world && world->blocked(Position(next_pos_x, next_pos_y)))
+        {
+            next_pos_x = curr_pos.x;
+            next_pos_y = curr_pos.y;
+        }
 
-        // Free our float array
-        free(move_deltas);
+        // Store location
+        if (scenario == 0)
+        {
+            path.push(next_pos_x, next_pos_y);
+            return;
+        }
+        ScenarioRun &run = scenario_runs[scenario - 1];
+        run.pos = Position(next_pos_x, next_pos_y);
+        run.num_steps++;
     }
 };
 
@@ -114,7 +361,7 @@ struct AgentDistancePair
     Agent *agent;
     float distance;
 
-    AgentDistancePair(Agent *agent, float distance) : agent(agent), distance(distance) {}
+    AgentDistancePair(Agent *agent = NULL, float distance = 0) : agent(agent), distance(distance) {}
 };
 
 /**
@@ -125,105 +372,46 @@ struct AgentDistancePair
  * @return true
  * @return false
  */
-bool compare_agent_distance_pair(AgentDistancePair *first, AgentDistancePair *second)
+bool compare_agent_distance_pair(const AgentDistancePair &first, const AgentDistancePair &second)
 {
-    return bool(first->distance < second->distance);
+    return bool(first.distance < second.distance);
 }
 
 /**
- * @brief Helper function to draw a generations moves
+ * @brief Work out how much of each Agent's path a generation needs to keep
+ *
+ * Full paths are only kept for the generations that are going to be handed to the Renderer.
  *
- * @param agents_and_distances Agent and Distance pairs
- * @param goal The position of the goal they are trying to get to
+ * @param generation_number The generation the Agents belong to
+ * @return TrajectoryRetention
  */
-void draw_agent_path(std::vector<AgentDistancePair *> *agents_and_distances, Position *goal, int generation_number)
+TrajectoryRetention trajectory_retention_for(int generation_number)
 {
-    // create the window
-    sf::RenderWindow window(sf::VideoMode(BOUNDARY_EDGE_LENGTH, BOUNDARY_EDGE_LENGTH), "Generation " + std::to_string(generation_number));
-    sf::RectangleShape shape;
-    sf::Clock clock;
-    sf::Time accumulator = sf::Time::Zero;
-    
-
-    while (window.isOpen())
-    {
-        int num_moves = (*agents_and_distances).at(0)->agent->positions.size();
-
-        for (int move = 0; move < num_moves; move++)
-        {
-            bool first_drawn = false;
-            shape.setSize(sf::Vector2f(DRAW_OBJECT_SIZE, DRAW_OBJECT_SIZE));
-
-            sf::Event event;
-            window.clear(sf::Color::Black);
-
-            // Draw our Goal
-            shape.setFillColor(sf::Color::Yellow);
-            shape.setPosition(sf::Vector2f(goal->x, goal->y));
-            window.draw(shape);
-
-            for (AgentDistancePair *adp : *agents_and_distances)
-            {
-                // Draw our Agent
-                Agent *agent = adp->agent;
-                shape.setFillColor(sf::Color::Red);
-                shape.setPosition(sf::Vector2f(agent->positions[move]->x, agent->positions[move]->y));
-                window.draw(shape);
-            }
-
-            // Re-Draw the top performer
-            shape.setFillColor(sf::Color::Green);
-            shape.setPosition(sf::Vector2f(agents_and_distances->at(0)->agent->positions[move]->x, agents_and_distances->at(0)->agent->positions[move]->y));
-            window.draw(shape);
-            
-
-            window.display();
-
-            while(accumulator.asSeconds() < DRAW_SECONDS_PER_FRAME){
-                accumulator += clock.restart();
-                while (window.pollEvent(event))
-                {
-                    if (event.type == sf::Event::Closed){
-                        window.close();
-                        return;
-                    }
-                }
-            }
-            accumulator = sf::Time::Zero;
-
-        }
-    }
+    if (config.draw_generation_performance && (generation_number % config.draw_every_nth_generation) == 0)
+        return FullHistory;
+    return EndpointsOnly;
 }
 
 /**
- * @brief Get the agent pointer and float distance from the goal so we can sort them.
+ * @brief Get the agent pointer and its fitness so we can sort them.
+ *
+ * With a single scenario the fitness is simply the final distance from the goal.
  *
  * @param agents The agents that were a part of a generation
- * @param goal The position of the goal that was used in the generation
+ * @param scenarios The scenarios that were used in the generation
+ * @param closest Filled with the closest agents, best first. Reused between generations so ranking never allocates
  * @param num_to_find The number of final agent distance pairs that the caller would like returned
- * @return std::vector<AgentDistancePair *>*
+ * @param reduction How each Agent's distances in the scenarios are combined
  */
-std::vector<AgentDistancePair *> *get_closest_agents(std::vector<Agent *> agents, Position *goal, int generation_number, int num_to_find = 2)
+void get_closest_agents(std::vector<Agent *> &agents, const std::vector<Scenario> &scenarios, std::vector<AgentDistancePair> &closest, int num_to_find = 2, FitnessReduction reduction = MeanDistance)
 {
-    std::vector<AgentDistancePair *> *agent_distance_pairs = new std::vector<AgentDistancePair *>;
-
+    closest.clear();
     for (Agent *a : agents)
-        agent_distance_pairs->push_back(new AgentDistancePair(a, get_distance(*(a->positions.back()), *goal)));
-
-    sort(agent_distance_pairs->begin(), agent_distance_pairs->end(), compare_agent_distance_pair);
-
-    if (DRAW_GENERATION_PERFORMANCE && (generation_number % DRAW_EVERY_NTH_GENERATION) == 0 && DRAW_FULL_POPULATION)
-        draw_agent_path(agent_distance_pairs, goal, generation_number);
-
-    while (agent_distance_pairs->size() > num_to_find)
-    {
-        delete agent_distance_pairs->back();
-        agent_distance_pairs->pop_back();
-    }
+        closest.push_back(AgentDistancePair(a, a->score(scenarios, reduction)));
 
-    if (DRAW_GENERATION_PERFORMANCE && (generation_number % DRAW_EVERY_NTH_GENERATION) == 0 && !DRAW_FULL_POPULATION)
-        draw_agent_path(agent_distance_pairs, goal, generation_number);
+    sort(closest.begin(), closest.end(), compare_agent_distance_pair);
 
-    return agent_distance_pairs;
+    if (closest.size() > (size_t)num_to_find)
+        closest.resize(num_to_find);
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,76 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include "config.hpp"
+
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+// Telemetry reports allocations per generation, so it needs them counted as well
+#define TRACK_ALLOCATIONS (COUNT_ALLOCATIONS || ENABLE_TELEMETRY)
+
+/**
+ * @brief Total number of heap allocations made by the program, only counted when COUNT_ALLOCATIONS or ENABLE_TELEMETRY
+ * is enabled.
+ */
+std::atomic<uint64_t> heap_allocations(0);
+
+/**
+ * @brief Get the number of heap allocations made so far
+ *
+ * Compare two readings to see how many allocations a piece of code made. Always 0 when allocations are not tracked.
+ *
+ * @return uint64_t
+ */
+uint64_t allocation_count()
+{
+    if (!TRACK_ALLOCATIONS)
+        return 0;
+    return heap_allocations.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief calloc that shows up in 'allocation_count', use this instead of calling calloc directly
+ *
+ * @param num Number of elements
+ * @param size Size of each element
+ * @return void* Expected to be released with free
+ */
+void *counted_calloc(size_t num, size_t size)
+{
+    if (TRACK_ALLOCATIONS)
+        heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    return calloc(num, size);
+}
+
+#if TRACK_ALLOCATIONS
+// The replacement new below allocates with malloc, so GCC's check that new is never paired with free doesn't apply
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+// Everything that goes through 'new' (including std::vector and the default new[]) is counted as well
+void *operator new(size_t size)
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *memory = malloc(size ? size : 1);
+    if (!memory)
+        throw std::bad_alloc();
+    return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+#endif
+#endif
@@ -0,0 +1,282 @@
+#include <cstdint>
+#include <vector>
+#include "neural_network.hpp"
+#include "simd.hpp"
+#include "utils.hpp"
+#include "config.hpp"
+
+#ifndef BATCHED_INFERENCE_H
+#define BATCHED_INFERENCE_H
+
+/**
+ * @brief One layer of a PopulationNetwork, its parameters for every agent in the chosen precision.
+ *
+ * The parameters are laid out as [parameter][agent] in the same order as 'Layer': the weights as [neuron][input], then
+ * one bias per neuron when the layer has them.
+ */
+struct BatchedLayer
+{
+    int num_inputs, num_neurons;
+    ActivationFunction activation;
+    bool has_biases;
+    std::vector<float> weights;
+    std::vector<uint16_t> weights_half;
+    std::vector<int8_t> weights_int8;
+    // With int8 weights, each agent's scale laid out as [agent]
+    std::vector<float> scales;
+
+    int num_parameters() const
+    {
+        return num_neurons * num_inputs + (has_biases ? num_neurons : 0);
+    }
+};
+
+/**
+ * @brief Holds the weights of a whole population in one contiguous tensor per layer so a tick can be run as a single
+ * batch.
+ *
+ * Everything is stored agent-minor: each layer's weights as [neuron][input][agent], and the inputs/outputs of a forward
+ * pass as [input][agent] and [output][agent]. This means the innermost loop of the forward pass always walks
+ * neighbouring agents, which is contiguous in memory and trivially vectorizable, instead of walking a 2 or 10 element
+ * dot product per agent. The hidden layers ping-pong between the two halves of one activation buffer, so the number of
+ * layers doesn't change the memory used.
+ *
+ * The weights can be stored as half floats or int8 instead, see 'WeightPrecision', halving or quartering the tensor and
+ * fitting 2 or 4 times as many agents' weights per cache line. They are widened to float in registers, everything
+ * else (inputs, activations, accumulation) stays float. Only the storage for the chosen precision is allocated.
+ */
+struct PopulationNetwork
+{
+    int num_agents, num_inputs, num_outputs;
+    // The widest hidden layer
+    int max_width;
+    WeightPrecision precision;
+    // The hidden layers in order from the inputs, then the output layer
+    std::vector<BatchedLayer> layers;
+    // Two halves of max_width * num_agents, each laid out as [neuron][agent]
+    std::vector<float> hidden_activations;
+    // Scratch space for callers to lay out a batch's inputs and receive its outputs
+    std::vector<float> inputs, outputs;
+    // Which agent, and in which scenario, currently sits in each slot of the batch, for callers that reorder agents with 'move_agent'
+    std::vector<int> slot_agent, slot_scenario;
+
+    /**
+     * @brief Construct a new Population Network object, empty until 'reshape' is called
+     *
+     * @param precision How the weights are stored
+     */
+    PopulationNetwork(WeightPrecision precision = config.weight_precision) : num_agents(0), num_inputs(0), num_outputs(0), max_width(0), precision(precision) {}
+
+    /**
+     * @brief Change the shape of the population, this only allocates if the population grew.
+     *
+     * A PopulationNetwork kept around between generations therefore costs no allocations after the first one.
+     *
+     * @param num_agents The number of agents (batch size) to hold weights for
+     * @param shape Any Neural Network with the population's shape
+     */
+    void reshape(int num_agents, NeuralNetwork *shape)
+    {
+        this->num_agents = num_agents;
+        num_inputs = shape->num_inputs;
+        num_outputs = shape->num_outputs;
+        max_width = shape->max_width;
+        layers.resize(shape->layers.size());
+        for (size_t layer_i = 0; layer_i < layers.size(); layer_i++)
+        {
+            BatchedLayer &layer = layers[layer_i];
+            Layer *source = shape->layers[layer_i];
+            layer.num_inputs = source->num_inputs;
+            layer.num_neurons = source->num_neurons;
+            layer.activation = source->activation;
+            layer.has_biases = source->biases != NULL;
+            int size = num_agents * layer.num_parameters();
+            if (precision == WeightsFloat32)
+                layer.weights.resize(size);
+            else if (precision == WeightsFloat16)
+                layer.weights_half.resize(size);
+            else
+            {
+                layer.weights_int8.resize(size);
+                layer.scales.resize(num_agents);
+            }
+        }
+        hidden_activations.resize(2 * num_agents * max_width);
+        inputs.resize(num_agents * num_inputs);
+        outputs.resize(num_agents * num_outputs);
+        slot_agent.resize(num_agents);
+        slot_scenario.resize(num_agents);
+    }
+
+    /**
+     * @brief Copy a single Neural Network into the population tensor.
+     *
+     * @param agent_index The slot in the batch this Neural Network will occupy
+     * @param nn The Neural Network to copy, expected to have the same shape as this population
+     */
+    void load(int agent_index, NeuralNetwork *nn)
+    {
+        for (size_t layer_i = 0; layer_i < layers.size(); layer_i++)
+        {
+            BatchedLayer &layer = layers[layer_i];
+            const float *source = nn->layers[layer_i]->weights;
+            int length = layer.num_parameters();
+            if (precision == WeightsFloat32)
+            {
+                for (int weight = 0; weight < length; weight++)
+                    layer.weights[weight * num_agents + agent_index] = source[weight];
+            }
+            else if (precision == WeightsFloat16)
+            {
+                for (int weight = 0; weight < length; weight++)
+                    layer.weights_half[weight * num_agents + agent_index] = float_to_half(source[weight]);
+            }
+            else
+                layer.scales[agent_index] = quantize(source, length, layer.weights_int8.data() + agent_index);
+        }
+    }
+
+    /**
+     * @brief Copy the weights in one slot of the batch over another, used to keep the agents still being simulated
+     * packed together at the front of a range.
+     *
+     * @param from The slot to copy
+     * @param to The slot to overwrite
+     */
+    void move_agent(int from, int to)
+    {
+        for (BatchedLayer &layer : layers)
+        {
+            if (precision == WeightsFloat32)
+                move_weights(layer.weights.data(), layer.num_parameters(), from, to);
+            else if (precision == WeightsFloat16)
+                move_weights(layer.weights_half.data(), layer.num_parameters(), from, to);
+            else
+            {
+                move_weights(layer.weights_int8.data(), layer.num_parameters(), from, to);
+                layer.scales[to] = layer.scales[from];
+            }
+        }
+        slot_agent[to] = slot_agent[from];
+        slot_scenario[to] = slot_scenario[from];
+    }
+
+    /**
+     * @brief Run the forward pass for agents [begin, end) in one go.
+     *
+     * The math is the same as NeuralNetwork::predict, just reordered so that every inner loop runs across agents and can
+     * use the SIMD kernels from 'simd.hpp'.
+     *
+     * @param begin The first agent in the batch
+     * @param end One past the last agent in the batch
+     * @param inputs Inputs laid out as [input][agent], num_inputs * num_agents long
+     * @param outputs Where to write the predictions, laid out as [output][agent], num_outputs * num_agents long
+     */
+    void forward(int begin, int end, const float *inputs, float *outputs)
+    {
+        const float *in = inputs;
+        for (size_t layer_i = 0; layer_i < layers.size(); layer_i++)
+        {
+            BatchedLayer &layer = layers[layer_i];
+            float *out = layer_i + 1 == layers.size() ? outputs : hidden_activations.data() + (layer_i % 2) * max_width * num_agents;
+            if (precision == WeightsFloat32)
+                batched_layer(layer, layer.weights.data(), NULL, in, out, begin, end);
+            else if (precision == WeightsFloat16)
+                batched_layer(layer, layer.weights_half.data(), NULL, in, out, begin, end);
+            else
+                batched_layer(layer, layer.weights_int8.data(), layer.scales.data(), in, out, begin, end);
+            in = out;
+        }
+    }
+
+private:
+    /**
+     * @brief Quantize one layer of one agent to int8 in the population tensor
+     *
+     * @param weights The layer's float weights
+     * @param length The number of weights in the layer
+     * @param out Where the first weight goes, every next one is num_agents further on
+     * @return float The scale to multiply the int8 weights by
+     */
+    float quantize(const float *weights, int length, int8_t *out)
+    {
+        float largest = 0;
+        for (int weight = 0; weight < length; weight++)
+            largest = std::max(largest, std::fabs(weights[weight]));
+        float scale = largest > 0 ? largest / 127 : 1;
+        for (int weight = 0; weight < length; weight++)
+            out[(size_t)weight * num_agents] = (int8_t)std::lrint(weights[weight] / scale);
+        return scale;
+    }
+
+    template <typename Weight>
+    void move_weights(Weight *weights, int length, int from, int to)
+    {
+        for (int weight = 0; weight < length; weight++)
+            weights[weight * num_agents + to] = weights[weight * num_agents + from];
+    }
+
+    void multiply_accumulate(float *total, const float *w, const float *x, int length)
+    {
+        simd.multiply_accumulate(total, w, x, length);
+    }
+
+    void multiply_accumulate(float *total, const uint16_t *w, const float *x, int length)
+    {
+        simd.multiply_accumulate_half(total, w, x, length);
+    }
+
+    void multiply_accumulate(float *total, const int8_t *w, const float *x, int length)
+    {
+        simd.multiply_accumulate_int8(total, w, x, length);
+    }
+
+    static float widen(float weight) { return weight; }
+    static float widen(uint16_t weight) { return half_to_float(weight); }
+    static float widen(int8_t weight) { return weight; }
+
+    /**
+     * @brief Calculate a layer's outputs for agents [begin, end).
+     *
+     * Biases are added after the weighted sum, like 'Layer' does, and int8 biases share the layer's scale.
+     *
+     * @param layer The layer's shape
+     * @param weights The layer's parameters laid out as [parameter][agent]
+     * @param scales Each agent's scale for int8 weights, NULL for float weights
+     * @param in Layer inputs laid out as [input][agent]
+     * @param out Layer outputs laid out as [neuron][agent]
+     */
+    template <typename Weight>
+    void batched_layer(const BatchedLayer &layer, const Weight *weights, const float *scales, const float *in, float *out, int begin, int end)
+    {
+        bool fast = config.use_fast_sigmoid;
+        const Weight *biases = weights + layer.num_neurons * layer.num_inputs * num_agents;
+        for (int neuron = 0; neuron < layer.num_neurons; neuron++)
+        {
+            float *total = out + neuron * num_agents;
+            for (int agent = begin; agent < end; agent++)
+                total[agent] = 0;
+
+            for (int input = 0; input < layer.num_inputs; input++)
+            {
+                const Weight *w = weights + (neuron * layer.num_inputs + input) * num_agents;
+                const float *x = in + input * num_agents;
+                multiply_accumulate(total + begin, w + begin, x + begin, end - begin);
+            }
+
+            if (layer.has_biases)
+            {
+                const Weight *bias = biases + neuron * num_agents;
+                for (int agent = begin; agent < end; agent++)
+                    total[agent] += widen(bias[agent]);
+            }
+
+            if (scales)
+                for (int agent = begin; agent < end; agent++)
+                    total[agent] *= scales[agent];
+
+            activate_array(total + begin, end - begin, layer.activation, fast);
+        }
+    }
+};
+#endif
@@ -0,0 +1,338 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "agents.hpp"
+#include "rng.hpp"
+
+#ifdef _WIN32
+#define CHECKPOINT_USE_MMAP 0
+#else
+#define CHECKPOINT_USE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#define CHECKPOINT_MAGIC "EVONNCKP"
+#define CHECKPOINT_VERSION 2
+
+/**
+ * @brief The fixed size start of a checkpoint file.
+ *
+ * The header is followed by one CheckpointLayer per layer of the Neural Network, output layer last, and header_size
+ * covers both. Then comes one record per selected agent: its float distance, then every layer's parameters in layer
+ * order (see 'NeuralNetwork::copy_parameters_to'), all as native floats. Everything is plain data so a mapped file can
+ * be used in place.
+ */
+struct CheckpointHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int32_t generation;
+    int32_t num_agents;
+    int32_t num_inputs, num_outputs;
+    int32_t num_layers, num_parameters;
+    uint64_t rng_state[4];
+    float goal_x, goal_y;
+    float start_x, start_y;
+    float mutation_chance;
+    int32_t has_biases;
+
+    /**
+     * @brief The size of a single agent record in floats
+     *
+     * @return int
+     */
+    int agent_floats() const
+    {
+        return 1 + num_parameters;
+    }
+};
+
+/**
+ * @brief The shape of one layer in a checkpoint, see 'CheckpointHeader'
+ */
+struct CheckpointLayer
+{
+    int32_t num_neurons;
+    int32_t activation;
+};
+
+/**
+ * @brief A loaded checkpoint, backed by a read-only memory mapping of the file where available.
+ */
+struct Checkpoint
+{
+    const CheckpointHeader *header;
+    const CheckpointLayer *layers;
+    const float *agent_records;
+
+private:
+    void *mapping;
+    size_t mapping_size;
+    std::vector<char> file_contents;
+
+public:
+    Checkpoint() : header(NULL), layers(NULL), agent_records(NULL), mapping(NULL), mapping_size(0) {}
+
+    ~Checkpoint()
+    {
+#if CHECKPOINT_USE_MMAP
+        if (mapping)
+            munmap(mapping, mapping_size);
+#endif
+    }
+
+    /**
+     * @brief Map a checkpoint file and check it is one we understand.
+     *
+     * @param path The checkpoint file
+     * @return true
+     * @return false The file is missing, truncated or from an incompatible version
+     */
+    bool load(const char *path)
+    {
+        const char *data = NULL;
+        size_t size = 0;
+#if CHECKPOINT_USE_MMAP
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+        {
+            mapping_size = file_stat.st_size;
+            mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+                mapping = NULL;
+        }
+        close(fd);
+        if (!mapping)
+            return false;
+        data = (const char *)mapping;
+        size = mapping_size;
+#else
+        FILE *file = fopen(path, "rb");
+        if (!file)
+            return false;
+        fseek(file, 0, SEEK_END);
+        file_contents.resize(ftell(file));
+        fseek(file, 0, SEEK_SET);
+        size = fread(file_contents.data(), 1, file_contents.size(), file);
+        fclose(file);
+        data = file_contents.data();
+#endif
+
+        if (size < sizeof(CheckpointHeader))
+            return false;
+        header = (const CheckpointHeader *)data;
+        if (memcmp(header->magic, CHECKPOINT_MAGIC, 8) != 0 || header->version != CHECKPOINT_VERSION || header->num_layers < 1 ||
+            header->header_size != sizeof(CheckpointHeader) + header->num_layers * sizeof(CheckpointLayer))
+            return false;
+        if (size < header->header_size + (size_t)header->num_agents * header->agent_floats() * sizeof(float))
+            return false;
+        layers = (const CheckpointLayer *)(data + sizeof(CheckpointHeader));
+        agent_records = (const float *)(data + header->header_size);
+        return true;
+    }
+
+    /**
+     * @brief Check the stored agents have the same Neural Network shape as ours
+     *
+     * @param nn
+     * @return true
+     * @return false
+     */
+    bool matches(NeuralNetwork *nn) const
+    {
+        if (header->num_inputs != nn->num_inputs || header->num_outputs != nn->num_outputs || header->num_layers != (int)nn->layers.size() ||
+            header->num_parameters != nn->num_parameters() || header->has_biases != (nn->layers[0]->biases != NULL))
+            return false;
+        for (int layer = 0; layer < header->num_layers; layer++)
+            if (layers[layer].num_neurons != nn->layers[layer]->num_neurons || layers[layer].activation != nn->layers[layer]->activation)
+                return false;
+        return true;
+    }
+
+    /**
+     * @brief Copy a stored agent's weights into an Agent and get its distance
+     *
+     * @param index Which stored agent to restore
+     * @param agent The Agent to overwrite, expected to have the same Neural Network shape as the checkpoint, see 'matches'
+     * @return float The stored agent's distance from the goal
+     */
+    float restore_agent(int index, Agent *agent)
+    {
+        const float *record = agent_records + (size_t)index * header->agent_floats();
+        agent->nn->copy_parameters_from(record + 1);
+        return record[0];
+    }
+};
+
+/**
+ * @brief Build a checkpoint image in memory.
+ *
+ * @param buffer Overwritten with the checkpoint, reusing its storage
+ * @param generation The generation that was just ranked
+ * @param closest The selected agents to store
+ * @param rng The generator whose state should be restored on resume
+ * @param goal
+ * @param start
+ * @param mutation_chance
+ */
+void serialize_checkpoint(std::vector<char> &buffer, int generation, std::vector<AgentDistancePair> &closest, Rng &rng, Position goal, Position start, float mutation_chance)
+{
+    NeuralNetwork *nn = closest.at(0).agent->nn;
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, 8);
+    header.version = CHECKPOINT_VERSION;
+    header.generation = generation;
+    header.num_agents = closest.size();
+    header.num_inputs = nn->num_inputs;
+    header.num_outputs = nn->num_outputs;
+    header.num_layers = nn->layers.size();
+    header.num_parameters = nn->num_parameters();
+    header.has_biases = nn->layers[0]->biases != NULL;
+    header.header_size = sizeof(CheckpointHeader) + header.num_layers * sizeof(CheckpointLayer);
+    memcpy(header.rng_state, rng.state, sizeof(header.rng_state));
+    header.goal_x = goal.x;
+    header.goal_y = goal.y;
+    header.start_x = start.x;
+    header.start_y = start.y;
+    header.mutation_chance = mutation_chance;
+
+    buffer.resize(header.header_size + (size_t)header.num_agents * header.agent_floats() * sizeof(float));
+    memcpy(buffer.data(), &header, sizeof(header));
+
+    CheckpointLayer *layers = (CheckpointLayer *)(buffer.data() + sizeof(CheckpointHeader));
+    for (int layer = 0; layer < header.num_layers; layer++)
+    {
+        layers[layer].num_neurons = nn->layers[layer]->num_neurons;
+        layers[layer].activation = nn->layers[layer]->activation;
+    }
+
+    float *record = (float *)(buffer.data() + header.header_size);
+    for (AgentDistancePair &adp : closest)
+    {
+        record[0] = adp.distance;
+        adp.agent->nn->copy_parameters_to(record + 1);
+        record += header.agent_floats();
+    }
+}
+
+/**
+ * @brief Writes checkpoints to disk on a background thread.
+ *
+ * The evolution loop only copies the state into a buffer, the file write happens on the writer thread. The file is
+ * written next to its final name and renamed over it, so a crash mid-write never leaves a broken checkpoint behind.
+ * If the previous checkpoint is still being written the new one is skipped rather than waited for.
+ */
+struct CheckpointWriter
+{
+private:
+    std::string path;
+    std::vector<char> pending, writing;
+    bool has_pending, stopping;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread writer;
+
+    void write_file(std::vector<char> &contents)
+    {
+        std::string temp_path = path + ".tmp";
+        FILE *file = fopen(temp_path.c_str(), "wb");
+        if (!file)
+            return;
+        bool ok = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+        ok = fflush(file) == 0 && ok;
+        fclose(file);
+        if (!ok)
+            return;
+#ifdef _WIN32
+        remove(path.c_str());
+#endif
+        if (rename(temp_path.c_str(), path.c_str()) == 0)
+            written++;
+    }
+
+    void writer_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [&]
+                      { return stopping || has_pending; });
+            if (!has_pending)
+                return;
+
+            pending.swap(writing);
+            has_pending = false;
+            busy = true;
+            lock.unlock();
+            write_file(writing);
+            lock.lock();
+            busy = false;
+        }
+    }
+
+public:
+    std::atomic<unsigned long> written;
+    unsigned long skipped;
+    bool busy;
+
+    /**
+     * @brief Construct a new Checkpoint Writer object and start its thread
+     *
+     * @param path Where checkpoints are written
+     */
+    CheckpointWriter(const char *path) : path(path), has_pending(false), stopping(false), written(0), skipped(0), busy(false)
+    {
+        writer = std::thread(&CheckpointWriter::writer_loop, this);
+    }
+
+    /**
+     * @brief Finishes writing any queued checkpoint before returning
+     */
+    ~CheckpointWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+    }
+
+    /**
+     * @brief Queue a checkpoint, see 'serialize_checkpoint' for the parameters
+     *
+     * @return true
+     * @return false The writer was still busy and this checkpoint was skipped
+     */
+    bool save(int generation, std::vector<AgentDistancePair> &closest, Rng &rng, Position goal, Position start, float mutation_chance)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (busy || has_pending)
+        {
+            skipped++;
+            return false;
+        }
+        serialize_checkpoint(pending, generation, closest, rng, goal, start, mutation_chance);
+        has_pending = true;
+        wake.notify_one();
+        return true;
+    }
+};
+#endif
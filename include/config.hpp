@@ -1,9 +1,18 @@
-#include "utils.hpp"
-
 /**
  * @brief World controls
  */
 #define BOUNDARY_EDGE_LENGTH 800
+#define NUM_OBSTACLES 0 // Round obstacles placed in every scenario, see scenario.hpp
+#define OBSTACLE_RADIUS 20
+#define NUM_SENSED_NEIGHBOURS 0 // Nearest other Agents each Agent can sense, more than 0 makes Agents interact
+#define SENSING_RADIUS 50 // How far away obstacles and other Agents can be sensed
+
+/**
+ * @brief Network Controls
+ */
+#define HIDDEN_LAYERS "10" // Comma separated widths, each can be followed by ':' and the layer's activation, e.g. "16:TanhActivation,8"
+#define OUTPUT_ACTIVATION SigmoidActivation // SigmoidActivation, TanhActivation, ReluActivation or LinearActivation
+#define USE_BIASES true
 
 /**
  * @brief Mutation Controls
@@ -21,6 +30,12 @@
 #define NUM_AGENTS_PER_GEN 100
 #define NUM_AGENTS_SELECTED_EACH_GENERATION 10
 
+/**
+ * @brief Fitness Controls
+ */
+#define NUM_SCENARIOS 1 // Start and goal pairs every Agent is evaluated on, see scenario.hpp
+#define FITNESS_REDUCTION MeanDistance
+
 /**
  * @brief Display Options
  */
@@ -29,4 +44,53 @@
 #define DRAW_SECONDS_PER_FRAME 0.01
 #define DRAW_OBJECT_SIZE 5
 #define DRAW_EVERY_NTH_GENERATION 5 
-#define DRAW_FULL_POPULATION true
\ No newline at end of file
+#define DRAW_FULL_POPULATION true
+#define RENDER_SNAPSHOT_SLOTS 3
+
+/**
+ * @brief Island Options
+ */
+#define NUM_ISLANDS 1 // More than 1 evolves that many populations at once, each on its own thread
+#define MIGRATION_EVERY_N_GENERATIONS 25 // 0 keeps the islands apart
+#define NUM_MIGRANTS 2
+
+/**
+ * @brief Worker Process Options
+ */
+#define NUM_WORKER_PROCESSES 0 // More than 0 evaluates each generation in that many forked processes
+#define WORKER_USE_TCP false // Talk to workers over localhost TCP instead of Unix sockets
+#define PIN_WORKER_PROCESSES false
+#define WORKER_TIMEOUT_SECONDS 60 // A worker that takes longer than this to reply is treated as dead, 0 waits forever
+
+/**
+ * @brief Checkpoint Options
+ */
+#define CHECKPOINT_EVERY_N_GENERATIONS 0 // 0 disables checkpointing, e.g. 100 writes CHECKPOINT_PATH every 100 generations
+#define CHECKPOINT_PATH "evonn.ckpt"
+#define RESUME_FROM_CHECKPOINT false
+
+/**
+ * @brief Replay Options
+ */
+#define SEED 0 // 0 seeds from the clock
+#define DETERMINISTIC false // Islands swap migrants in lockstep, so a seed gives the same results on any number of threads
+#define TRACE_PATH "" // Where every generation's best distance is recorded, empty disables it, see trace.hpp
+#define VERIFY_TRACE false // Compare the run against the trace at TRACE_PATH instead of writing it
+
+/**
+ * @brief Telemetry Options
+ */
+#define ENABLE_TELEMETRY false // Compiles in the per generation phase timers and counters, see telemetry.hpp
+#define TELEMETRY_PATH "evonn_telemetry.csv" // A .json or .jsonl path writes JSON lines instead of CSV
+
+/**
+ * @brief Performance Options
+ */
+#define USE_BATCHED_INFERENCE true
+#define WEIGHT_PRECISION WeightsFloat32 // Batched inference only: WeightsFloat32, WeightsFloat16 or WeightsInt8
+#define EARLY_EXIT_SETTLED_AGENTS true
+#define NUM_THREADS 0 // 0 uses one thread per hardware thread
+#define USE_FAST_SIGMOID false
+#define USE_FIXED_TOPOLOGY_NETWORK true // Per-agent inference only, see FixedNeuralNetwork
+#define COUNT_ALLOCATIONS false
+#define FITNESS_CACHE_SIZE 65536 // Entries in each island's fitness cache, 0 disables it, see FitnessCache
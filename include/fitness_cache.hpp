@@ -0,0 +1,268 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "agents.hpp"
+#include "scenario.hpp"
+#include "telemetry.hpp"
+
+#ifndef FITNESS_CACHE_H
+#define FITNESS_CACHE_H
+
+// How far past its home slot an entry can end up, bounds the cost of a miss
+#define FITNESS_CACHE_MAX_PROBES 8
+
+/**
+ * @brief Mix a run of floats into a 64 bit hash, by their bits so -0 and 0 hash differently
+ *
+ * @param hash The hash so far
+ * @param values
+ * @param length
+ * @return uint64_t
+ */
+uint64_t hash_floats(uint64_t hash, const float *values, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        uint32_t bits;
+        memcpy(&bits, values + i, sizeof(bits));
+        hash = (hash ^ bits) * 0x100000001B3ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/**
+ * @brief Hash a Neural Network's weights, identical genomes always give the same hash
+ *
+ * @param nn
+ * @return uint64_t
+ */
+uint64_t genome_hash(NeuralNetwork *nn)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (Layer *layer : nn->layers)
+        hash = hash_floats(hash, layer->weights, layer->num_parameters());
+    return hash;
+}
+
+/**
+ * @brief Hash a set of scenarios, so cached results are never used for a different start, goal or obstacles
+ *
+ * @param scenarios
+ * @return uint64_t
+ */
+uint64_t scenario_hash(const std::vector<Scenario> &scenarios)
+{
+    uint64_t hash = 0x84222325CBF29CE4ull;
+    for (const Scenario &scenario : scenarios)
+    {
+        float coordinates[4] = {scenario.start.x, scenario.start.y, scenario.goal.x, scenario.goal.y};
+        hash = hash_floats(hash, coordinates, 4);
+        for (const Position &obstacle : scenario.obstacles)
+        {
+            float centre[3] = {obstacle.x, obstacle.y, scenario.obstacle_radius};
+            hash = hash_floats(hash, centre, 3);
+        }
+    }
+    return hash;
+}
+
+/**
+ * @brief Remembers where Agents ended up, so an Agent whose genome has already been simulated is never simulated again.
+ *
+ * Late in a run most children are bit-identical to an earlier genome, and an Agent's run depends only on its weights and
+ * the scenarios, so their final positions can be copied instead of simulating every tick again. Entries are keyed by a
+ * 64 bit hash of both, a collision would hand an Agent another genome's result but is vanishingly unlikely.
+ *
+ * The table is open addressed with linear probing over a fixed number of slots, so it never allocates once built.
+ * When every slot an entry could take is full, the one at its home slot is replaced.
+ *
+ * Only the final position in each scenario is kept, so generations that are going to be drawn bypass the cache.
+ */
+struct FitnessCache
+{
+private:
+    int num_scenarios;
+    uint64_t mask;
+    // 0 marks an empty slot
+    std::vector<uint64_t> keys;
+    // [slot][scenario][x, y]
+    std::vector<float> positions;
+    // The Agents that missed in the last lookup and their keys, reused every generation. After 'lookup_range' each
+    // slice's misses are followed by NULLs up to the next slice
+    std::vector<Agent *> misses;
+    std::vector<uint64_t> miss_keys;
+    // What the current lookup is for, see 'begin_lookup'
+    uint64_t scenarios_key;
+    const std::vector<Scenario> *scenarios;
+
+    static uint64_t key_for(Agent *agent, uint64_t scenarios_key)
+    {
+        uint64_t key = genome_hash(agent->nn) ^ scenarios_key;
+        return key ? key : 1;
+    }
+
+    /**
+     * @brief Find the slot holding a key
+     *
+     * @param key
+     * @return int The slot, -1 when the key is not cached
+     */
+    int find(uint64_t key) const
+    {
+        for (int probe = 0; probe < FITNESS_CACHE_MAX_PROBES; probe++)
+        {
+            uint64_t candidate = keys[(key + probe) & mask];
+            if (candidate == key)
+                return (key + probe) & mask;
+            if (candidate == 0)
+                return -1;
+        }
+        return -1;
+    }
+
+public:
+    uint64_t hits, total_misses;
+
+    /**
+     * @brief Construct a new Fitness Cache object
+     *
+     * @param capacity The number of entries to hold, rounded up to a power of two, 0 disables the cache
+     * @param num_scenarios The number of scenarios every Agent is run on
+     */
+    FitnessCache(int capacity, int num_scenarios) : num_scenarios(num_scenarios), mask(0), scenarios_key(0), scenarios(NULL), hits(0), total_misses(0)
+    {
+        if (capacity <= 0)
+            return;
+        uint64_t slots = 1;
+        while (slots < (uint64_t)capacity)
+            slots *= 2;
+        mask = slots - 1;
+        keys.assign(slots, 0);
+        positions.resize(slots * num_scenarios * 2);
+    }
+
+    bool enabled() const
+    {
+        return !keys.empty();
+    }
+
+    /**
+     * @brief Finish every Agent whose genome is cached and collect the rest
+     *
+     * Hits are left at their final position in every scenario, as if they had been simulated.
+     *
+     * @param agents The generation, already reset to the first scenario's start
+     * @param scenarios The scenarios the generation is about to be run on
+     * @return std::vector<Agent *>& The Agents that still need simulating, valid until the next lookup
+     */
+    std::vector<Agent *> &lookup(std::vector<Agent *> &agents, const std::vector<Scenario> &scenarios)
+    {
+        begin_lookup(agents.size(), scenarios);
+        int num_misses = lookup_range(agents, 0, agents.size());
+        end_lookup();
+        misses.resize(num_misses);
+        return misses;
+    }
+
+    /**
+     * @brief Get ready for 'lookup_range' to be called on slices of a generation, possibly from several threads
+     *
+     * @param num_agents The number of Agents in the generation
+     * @param scenarios The scenarios the generation is about to be run on
+     * @return std::vector<Agent *>& Where each slice's misses are packed, see 'lookup_range'
+     */
+    std::vector<Agent *> &begin_lookup(int num_agents, const std::vector<Scenario> &scenarios)
+    {
+        scenarios_key = scenario_hash(scenarios);
+        this->scenarios = &scenarios;
+        misses.assign(num_agents, NULL);
+        miss_keys.resize(num_agents);
+        return misses;
+    }
+
+    /**
+     * @brief 'lookup' for agents [begin, end), the misses are packed into [begin, begin + misses) of the vector
+     * 'begin_lookup' returned.
+     *
+     * The table is only read here, so slices can be looked up from several threads at once. Every slice has to be looked
+     * up before 'end_lookup', and 'store' only runs after that.
+     *
+     * @param agents The generation, already reset to the first scenario's start
+     * @param begin
+     * @param end
+     * @return int The number of misses in the slice
+     */
+    int lookup_range(std::vector<Agent *> &agents, int begin, int end)
+    {
+        int num_misses = 0;
+        for (int agent_i = begin; agent_i < end; agent_i++)
+        {
+            Agent *agent = agents[agent_i];
+            uint64_t key = key_for(agent, scenarios_key);
+            int slot = find(key);
+            if (slot < 0)
+            {
+                misses[begin + num_misses] = agent;
+                miss_keys[begin + num_misses] = key;
+                num_misses++;
+                continue;
+            }
+
+            agent->reset_scenarios(*scenarios);
+            const float *entry = positions.data() + (size_t)slot * num_scenarios * 2;
+            for (int scenario = 0; scenario < num_scenarios; scenario++)
+                agent->finish_scenario(scenario, Position(entry[scenario * 2], entry[scenario * 2 + 1]));
+        }
+        return num_misses;
+    }
+
+    /**
+     * @brief Count the hits and misses once every slice has been looked up
+     */
+    void end_lookup()
+    {
+        uint64_t num_misses = 0;
+        for (Agent *agent : misses)
+            num_misses += agent != NULL;
+        uint64_t num_hits = misses.size() - num_misses;
+
+        hits += num_hits;
+        total_misses += num_misses;
+        TELEMETRY_COUNT(CounterCacheHits, num_hits);
+        TELEMETRY_COUNT(CounterCacheMisses, num_misses);
+    }
+
+    /**
+     * @brief Remember where the Agents that missed in the last lookup ended up, call once they have been simulated
+     */
+    void store()
+    {
+        for (size_t miss = 0; miss < misses.size(); miss++)
+        {
+            if (!misses[miss])
+                continue;
+            uint64_t key = miss_keys[miss];
+            int slot = key & mask;
+            for (int probe = 0; probe < FITNESS_CACHE_MAX_PROBES; probe++)
+            {
+                int candidate = (key + probe) & mask;
+                if (keys[candidate] == 0 || keys[candidate] == key)
+                {
+                    slot = candidate;
+                    break;
+                }
+            }
+
+            keys[slot] = key;
+            float *entry = positions.data() + (size_t)slot * num_scenarios * 2;
+            for (int scenario = 0; scenario < num_scenarios; scenario++)
+            {
+                Position final_pos = misses[miss]->scenario_position(scenario);
+                entry[scenario * 2] = final_pos.x;
+                entry[scenario * 2 + 1] = final_pos.y;
+            }
+        }
+    }
+};
+#endif
@@ -0,0 +1,119 @@
+#include <array>
+#include <cstring>
+#include <utility>
+#include "utils.hpp"
+#include "config.hpp"
+#include "runtime_config.hpp"
+#include "neural_network.hpp"
+
+#ifndef FIXED_NEURALNET_H
+#define FIXED_NEURALNET_H
+
+template <int Count, typename Function, int... Indices>
+inline void unrolled_impl(Function &fn, std::integer_sequence<int, Indices...>)
+{
+    (fn(std::integral_constant<int, Indices>()), ...);
+}
+
+/**
+ * @brief Call fn(0), fn(1), ... fn(Count - 1) with each index as a compile time constant, so the loop is always
+ * fully unrolled.
+ *
+ * @tparam Count The number of iterations
+ * @param fn Called with a std::integral_constant<int, i> for each iteration
+ */
+template <int Count, typename Function>
+inline void unrolled(Function &&fn)
+{
+    unrolled_impl<Count>(fn, std::make_integer_sequence<int, Count>());
+}
+
+/**
+ * @brief A Neural Network with its shape fixed at compile time.
+ *
+ * The weights are held inline in std::arrays with the same [neuron][input] layout as 'Layer', and every loop of the
+ * forward pass is unrolled, so for small networks the compiler can keep the whole forward pass in registers. It is an
+ * inference copy of a regular 'NeuralNetwork', which still does all of the merging and mutating, see 'load'. Only a
+ * single sigmoid hidden layer and a sigmoid output layer are covered, networks without biases get zero biases.
+ *
+ * @tparam Inputs Number of inputs to the Neural Network
+ * @tparam Hidden Number of neurons in the hidden layer
+ * @tparam Outputs Number of outputs from the Neural Network
+ */
+template <int Inputs, int Hidden, int Outputs>
+struct FixedNeuralNetwork
+{
+    std::array<float, Hidden * Inputs> hidden_weights;
+    std::array<float, Outputs * Hidden> output_weights;
+    std::array<float, Hidden> hidden_biases;
+    std::array<float, Outputs> output_biases;
+
+    /**
+     * @brief Check whether a dynamic Neural Network has this network's shape
+     *
+     * @param nn
+     * @return true
+     * @return false
+     */
+    static bool matches(NeuralNetwork *nn)
+    {
+        return nn->num_inputs == Inputs && nn->num_outputs == Outputs && nn->layers.size() == 2 && nn->layers[0]->num_neurons == Hidden &&
+               nn->layers[0]->activation == SigmoidActivation && nn->layers[1]->activation == SigmoidActivation;
+    }
+
+    /**
+     * @brief Copy the weights of a dynamic Neural Network, expected to have this network's shape (see 'matches')
+     *
+     * @param nn
+     */
+    void load(NeuralNetwork *nn)
+    {
+        memcpy(hidden_weights.data(), nn->layers[0]->weights, sizeof(hidden_weights));
+        memcpy(output_weights.data(), nn->layers[1]->weights, sizeof(output_weights));
+        load_biases(hidden_biases.data(), nn->layers[0]);
+        load_biases(output_biases.data(), nn->layers[1]);
+    }
+
+    /**
+     * @brief Given the inputs what would the neural network output.
+     *
+     * @param inputs Expected to be Inputs long
+     * @param outputs Where to write the predictions, expected to be Outputs long
+     */
+    void predict(const float *inputs, float *outputs) const
+    {
+        // Picked once here so the unrolled layers have no branches in them
+        if (config.use_fast_sigmoid)
+            forward<true>(inputs, outputs);
+        else
+            forward<false>(inputs, outputs);
+    }
+
+private:
+    template <bool FastSigmoid>
+    void forward(const float *inputs, float *outputs) const
+    {
+        float hidden_out[Hidden];
+        layer<FastSigmoid, Inputs, Hidden>(hidden_weights.data(), hidden_biases.data(), inputs, hidden_out);
+        layer<FastSigmoid, Hidden, Outputs>(output_weights.data(), output_biases.data(), hidden_out, outputs);
+    }
+
+    static void load_biases(float *into, Layer *layer)
+    {
+        for (int neuron = 0; neuron < layer->num_neurons; neuron++)
+            into[neuron] = layer->biases ? layer->biases[neuron] : 0;
+    }
+
+    template <bool FastSigmoid, int LayerInputs, int LayerNeurons>
+    static void layer(const float *weights, const float *biases, const float *inputs, float *outputs)
+    {
+        unrolled<LayerNeurons>([&](auto neuron)
+                               {
+            float sum = 0;
+            unrolled<LayerInputs>([&](auto input)
+                                  { sum += inputs[input] * weights[neuron * LayerInputs + input]; });
+            sum += biases[neuron];
+            outputs[neuron] = FastSigmoid ? fast_sigmoid(sum) : sigmoid(sum); });
+    }
+};
+#endif
@@ -0,0 +1,603 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "agents.hpp"
+#include "checkpoint.hpp"
+#include "fitness_cache.hpp"
+#include "population.hpp"
+#include "process_pool.hpp"
+#include "renderer.hpp"
+#include "rng.hpp"
+#include "runtime_config.hpp"
+#include "scenario.hpp"
+#include "simulation.hpp"
+#include "telemetry.hpp"
+#include "trace.hpp"
+
+#ifndef ISLAND_H
+#define ISLAND_H
+
+/**
+ * @brief A mailbox of migrants that one island writes and one other island reads, without either side ever waiting.
+ *
+ * It is a sequence lock: the writer makes the sequence odd, stores the migrants and makes it even again. The reader
+ * copies the migrants out between two reads of the sequence and throws the copy away if the sequence moved, trying
+ * again at its next migration. Every value is a relaxed atomic so torn reads are well defined, just discarded.
+ *
+ * A migrant is stored as its distance from the goal, then every layer's parameters in layer order, see
+ * 'NeuralNetwork::copy_parameters_to'.
+ */
+struct MigrantExchange
+{
+private:
+    std::atomic<unsigned> sequence;
+    std::atomic<float> *values;
+
+public:
+    int num_migrants, migrant_floats;
+
+    /**
+     * @brief Construct a new Migrant Exchange object
+     *
+     * @param num_migrants The number of migrants sent each time
+     * @param migrant_floats The size of a single migrant, see 'MigrantExchange'
+     */
+    MigrantExchange(int num_migrants, int migrant_floats) : sequence(0), num_migrants(num_migrants), migrant_floats(migrant_floats)
+    {
+        values = new std::atomic<float>[num_migrants * migrant_floats];
+        for (int value = 0; value < num_migrants * migrant_floats; value++)
+            values[value].store(0, std::memory_order_relaxed);
+    }
+
+    ~MigrantExchange()
+    {
+        delete[] values;
+    }
+
+    /**
+     * @brief Send the best agents, only call from the island that owns this exchange
+     *
+     * @param closest The ranked agents, best first, at least num_migrants long
+     */
+    void publish(std::vector<AgentDistancePair> &closest)
+    {
+        unsigned start = sequence.load(std::memory_order_relaxed);
+        sequence.store(start + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (int migrant = 0; migrant < num_migrants; migrant++)
+        {
+            NeuralNetwork *nn = closest[migrant].agent->nn;
+            std::atomic<float> *record = values + migrant * migrant_floats;
+
+            record[0].store(closest[migrant].distance, std::memory_order_relaxed);
+            int offset = 1;
+            for (Layer *layer : nn->layers)
+                for (int weight = 0; weight < layer->num_parameters(); weight++)
+                    record[offset++].store(layer->weights[weight], std::memory_order_relaxed);
+        }
+
+        sequence.store(start + 2, std::memory_order_release);
+    }
+
+    /**
+     * @brief Copy out the newest migrants, only call from the one island that reads this exchange
+     *
+     * @param into Where to copy the migrants, num_migrants * migrant_floats long
+     * @param last_seen The sequence of the last batch collected, updated when a new batch is collected
+     * @return true
+     * @return false Nothing new has been published, or it was being written to while we read it
+     */
+    bool collect(float *into, unsigned &last_seen)
+    {
+        unsigned before = sequence.load(std::memory_order_acquire);
+        if ((before & 1) || before == last_seen)
+            return false;
+
+        for (int value = 0; value < num_migrants * migrant_floats; value++)
+            into[value] = values[value].load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence.load(std::memory_order_relaxed) != before)
+            return false;
+        last_seen = before;
+        return true;
+    }
+};
+
+/**
+ * @brief Holds every island's thread until all of them have arrived, for migrating in lockstep.
+ *
+ * Only used in deterministic mode, where every island publishes before any of them collects and every island has
+ * collected before any publishes again, so the migrants an island takes in never depend on thread timing.
+ */
+struct MigrationBarrier
+{
+private:
+    std::mutex mutex;
+    std::condition_variable released;
+    int num_threads, waiting;
+    unsigned long round;
+
+public:
+    MigrationBarrier(int num_threads) : num_threads(num_threads), waiting(0), round(0) {}
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        unsigned long arrived_in = round;
+        if (++waiting == num_threads)
+        {
+            waiting = 0;
+            round++;
+            released.notify_all();
+            return;
+        }
+        released.wait(lock, [&]
+                      { return round != arrived_in; });
+    }
+};
+
+/**
+ * @brief One population evolving towards the goal, with everything it needs to do so on its own thread.
+ */
+struct Island
+{
+    Population population;
+    PopulationNetwork network;
+    // The last generation's selected agents, best first
+    std::vector<AgentDistancePair> closest;
+    Position start, goal;
+    // Every Agent is evaluated on all of these, the first is start and goal, see 'make_scenarios'
+    std::vector<Scenario> scenarios;
+    float mutation_chance;
+    // Only one island can hand generations to the Renderer
+    bool drawn;
+    // Where this island's emigrants wait to be collected by its neighbour
+    MigrantExchange outbox;
+    // When set, generations are evaluated in these worker processes instead of the thread pool
+    ProcessPool *workers;
+    // Genomes this island has already simulated, see 'FitnessCache'
+    FitnessCache cache;
+
+private:
+    std::vector<float> inbox;
+    unsigned last_collected;
+
+    /**
+     * @brief Breed and simulate a generation in a single pass over the pool.
+     *
+     * Each thread breeds its slice and goes straight on to simulating it, so no thread waits for the rest of the
+     * generation to be bred and breeding overlaps with the other slices' simulation. With the cache a slice is looked
+     * up as soon as it is bred and only its misses are simulated. The pass's time is split between PhaseBreed and
+     * PhaseSimulate by how long the slices spent on each.
+     *
+     * @param generation The Agents to breed into, or to reset when parents is NULL
+     * @param parents The previous generation's selected Agents, NULL for the first generation
+     * @param streams Every child's generator is split from this, see 'setup_agent_range'
+     * @param retention How much of each Agent's path to keep
+     * @param use_cache Skip the Agents whose genome has been simulated before
+     * @param pool The threads to split the generation between
+     */
+    void breed_and_simulate(std::vector<Agent *> &generation, std::vector<AgentDistancePair> *parents, const Rng &streams, TrajectoryRetention retention, bool use_cache, ThreadPool &pool)
+    {
+        std::vector<Agent *> *misses = NULL;
+        {
+            TELEMETRY_PHASE(PhaseSimulate);
+            if (config.use_batched_inference)
+                shape_population(network, generation, scenarios.size());
+            // Each slice's misses are packed at the start of its own range, so they keep their own slots in the batch
+            if (use_cache)
+                misses = &cache.begin_lookup(generation.size(), scenarios);
+        }
+
+        {
+            TELEMETRY_SPLIT_PHASES(split, PhaseBreed, PhaseSimulate);
+            auto slice = [&](int begin, int end)
+            {
+                {
+                    TELEMETRY_SLICE(split, first);
+                    setup_agent_range(generation, begin, end, &start, parents, config.merge_strategy, mutation_chance, retention, streams);
+                }
+                TELEMETRY_SLICE(split, second);
+                if (misses)
+                    run_sim_range(*misses, begin, begin + cache.lookup_range(generation, begin, end), scenarios, network);
+                else
+                    run_sim_range(generation, begin, end, scenarios, network);
+            };
+            pool.parallel_for(generation.size(), slice);
+        }
+
+        TELEMETRY_PHASE(PhaseSimulate);
+        if (use_cache)
+        {
+            cache.end_lookup();
+            cache.store();
+        }
+    }
+
+public:
+    /**
+     * @brief Construct a new Island object
+     *
+     * @param start The start position for every Agent
+     * @param goal The position of the goal the Agents are trying to get to
+     * @param drawn Whether this island's generations are kept for the Renderer
+     */
+    Island(Position start, Position goal, bool drawn = true) : population(config.num_agents_per_gen, start, config.num_sensors()), start(start), goal(goal),
+                                                               scenarios(make_scenarios(start, goal, config.num_scenarios, config.boundary_edge_length, config.num_obstacles, config.obstacle_radius, config.draw_object_size)), mutation_chance(0), drawn(drawn),
+                                                               outbox(config.num_migrants, migrant_floats(population.current()[0]->nn)), workers(NULL),
+                                                               cache(config.fitness_cache_size, config.num_scenarios), last_collected(0)
+    {
+        closest.reserve(config.num_agents_per_gen);
+        inbox.resize(outbox.num_migrants * outbox.migrant_floats);
+    }
+
+    /**
+     * @brief Move the start and goal, along with the scenarios built from them
+     *
+     * @param start The start position for every Agent
+     * @param goal The position of the goal the Agents are trying to get to
+     */
+    void place(Position start, Position goal)
+    {
+        this->start = start;
+        this->goal = goal;
+        scenarios = make_scenarios(start, goal, config.num_scenarios, config.boundary_edge_length, config.num_obstacles, config.obstacle_radius, config.draw_object_size);
+    }
+
+    /**
+     * @brief Work out how much of each Agent's path a generation on this island needs to keep
+     *
+     * @param generation_number
+     * @return TrajectoryRetention
+     */
+    TrajectoryRetention retention_for(int generation_number)
+    {
+        return drawn ? trajectory_retention_for(generation_number) : EndpointsOnly;
+    }
+
+    /**
+     * @brief Breed, simulate and rank one generation
+     *
+     * The first generation keeps the random Neural Networks the Agents were created with, every later one is bred
+     * from the previous generation's selected agents into the inactive buffer. That leaves the previous generation
+     * untouched until the one after this, so it can still be reported on while this one runs, see 'GenerationReporter'.
+     *
+     * @param generation_number
+     * @param pool The threads to split the simulation between
+     */
+    void evolve(int generation_number, ThreadPool &pool)
+    {
+        TrajectoryRetention retention = retention_for(generation_number);
+        std::vector<AgentDistancePair> *parents = NULL;
+        Rng streams = generator;
+        if (!closest.empty())
+        {
+            float max_distance = get_distance(Position(0, 0), Position(config.boundary_edge_length, config.boundary_edge_length));
+            // Distance Percentage, approaches 0 as the best performing agent gets closer to the goal
+            float dist_perc = closest.at(0).distance / max_distance;
+            // Base our mutation chance on how close we are to the goal.
+            mutation_chance = std::min(config.mutation_chance_c_value * pow(2, (dist_perc * config.mutation_chance_limit)), config.max_mutation_chance);
+            parents = &closest;
+            // Every generation gets its own streams, so breeding never advances the island's generator
+            streams = generator.split(generation_number);
+        }
+        std::vector<Agent *> &generation = parents ? population.next() : population.current();
+
+        // Drawn generations need every Agent's full path, and Agents that sense each other don't have a result of their
+        // own, so neither can be cached
+        bool use_cache = cache.enabled() && retention == EndpointsOnly && config.num_sensed_neighbours == 0;
+        if (workers || config.num_sensed_neighbours > 0)
+        {
+            // Both need the whole generation bred before any of it is simulated
+            {
+                TELEMETRY_PHASE(PhaseBreed);
+                setup_agent_generation(generation, &start, parents, config.merge_strategy, mutation_chance, retention, streams, &pool);
+            }
+
+            TELEMETRY_PHASE(PhaseSimulate);
+            std::vector<Agent *> &to_simulate = use_cache ? cache.lookup(generation, scenarios) : generation;
+            if (workers)
+                workers->run_sim(to_simulate, scenarios, network);
+            else
+                run_sim(to_simulate, scenarios, network, pool);
+            if (use_cache)
+                cache.store();
+        }
+        else
+            breed_and_simulate(generation, parents, streams, retention, use_cache, pool);
+        if (parents)
+            population.swap();
+
+        // Rank our agents and take the configured number of top performers
+        TELEMETRY_PHASE(PhaseRank);
+        get_closest_agents(population.current(), scenarios, closest, config.num_agents_selected_each_generation, config.fitness_reduction);
+    }
+
+    /**
+     * @brief Take in the newest migrants from another island, if there are any.
+     *
+     * Immigrants take the places of the worst selected agents, so they get to breed in the next generation. Every
+     * island shares the same scenarios so their fitnesses can be compared directly.
+     *
+     * @param source The other island's outbox
+     * @return true
+     * @return false There were no new migrants
+     */
+    bool immigrate(MigrantExchange &source)
+    {
+        if (!source.collect(inbox.data(), last_collected))
+            return false;
+
+        for (int migrant = 0; migrant < source.num_migrants; migrant++)
+        {
+            const float *record = inbox.data() + migrant * source.migrant_floats;
+            AgentDistancePair &replaced = closest[closest.size() - 1 - migrant];
+            replaced.agent->nn->copy_parameters_from(record + 1);
+            replaced.distance = record[0];
+        }
+        sort(closest.begin(), closest.end(), compare_agent_distance_pair);
+        return true;
+    }
+
+    /**
+     * @brief The size of a single migrant in floats, see 'MigrantExchange'
+     *
+     * @param nn
+     * @return int
+     */
+    static int migrant_floats(NeuralNetwork *nn)
+    {
+        return 1 + nn->num_parameters();
+    }
+};
+
+/**
+ * @brief Everything needed to report on a generation after the next one has started evolving
+ */
+struct GenerationReport
+{
+    int generation;
+    // The generation's agents, left alone until the generation after next is bred over them
+    std::vector<Agent *> *agents;
+    // A copy, the island ranks the next generation into its own
+    std::vector<AgentDistancePair> closest;
+    const Scenario *scenario;
+    // Printed with the mutation chance, taken after any migration
+    float best_distance;
+    float mutation_chance;
+    Rng rng;
+    Position goal, start;
+    bool draw, checkpoint;
+    uint64_t allocations;
+    TELEMETRY_ONLY(TelemetrySample telemetry;)
+
+    GenerationReport() : generation(0), agents(NULL), scenario(NULL), best_distance(0), mutation_chance(0), goal(0, 0), start(0, 0), draw(false), checkpoint(false), allocations(0) {}
+};
+
+/**
+ * @brief Reports on each generation on a background thread while the next one evolves.
+ *
+ * Handing the generation to the Renderer, queueing checkpoints, printing and writing telemetry all happen here, so the
+ * evolution loop only copies the few things the next generation overwrites. A generation's agents are kept until the
+ * generation after next is bred into their buffer, see 'Population', and that can't start before the loop has asked
+ * for its next report, which waits for the one before it to finish.
+ */
+struct GenerationReporter
+{
+private:
+    GenerationReport report;
+    bool has_pending, busy, stopping;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::thread reporter;
+    Renderer *renderer;
+    CheckpointWriter *checkpoint_writer;
+    ReplayTrace *trace;
+    // Printed before every line in island mode, -1 when there is only one island
+    int island_index;
+    std::mutex *print_mutex;
+
+    void publish()
+    {
+        if (report.draw)
+        {
+            TELEMETRY_PHASE(PhaseDraw);
+            renderer->submit(*report.agents, report.closest, *report.scenario, report.generation);
+        }
+
+        {
+            TELEMETRY_PHASE(PhaseCleanup);
+            if (trace)
+                trace->record(island_index < 0 ? 0 : island_index, report.generation, report.best_distance);
+
+            if (report.checkpoint)
+                checkpoint_writer->save(report.generation, report.closest, report.rng, report.goal, report.start, report.mutation_chance);
+
+            if (COUNT_ALLOCATIONS && island_index < 0)
+                std::cout << "Generation " << report.generation << " heap allocations: " << report.allocations << std::endl;
+
+            if (config.print_generation_performance)
+            {
+                if (island_index < 0)
+                    std::cout << report.best_distance << "," << report.mutation_chance << std::endl;
+                else
+                {
+                    std::lock_guard<std::mutex> lock(*print_mutex);
+                    std::cout << island_index << "," << report.best_distance << "," << report.mutation_chance << std::endl;
+                }
+            }
+        }
+
+        TELEMETRY_ONLY(if (telemetry) telemetry->write(report.telemetry);)
+    }
+
+    void reporter_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [&]
+                      { return stopping || has_pending; });
+            if (!has_pending)
+                return;
+
+            has_pending = false;
+            busy = true;
+            lock.unlock();
+            publish();
+            lock.lock();
+            busy = false;
+            idle.notify_one();
+        }
+    }
+
+public:
+    TELEMETRY_ONLY(TelemetryWriter *telemetry;)
+
+    /**
+     * @brief Construct a new Generation Reporter object and start its thread
+     *
+     * @param renderer Handed the generations marked for drawing, can be NULL
+     * @param checkpoint_writer Queued the generations marked for checkpointing, can be NULL
+     * @param trace Records every generation's best distance, can be NULL
+     * @param island_index Printed before every line in island mode, -1 when there is only one island
+     * @param print_mutex Shared by every island's reporter so lines never interleave, only needed in island mode
+     */
+    GenerationReporter(Renderer *renderer, CheckpointWriter *checkpoint_writer, ReplayTrace *trace, int island_index = -1, std::mutex *print_mutex = NULL)
+        : has_pending(false), busy(false), stopping(false), renderer(renderer), checkpoint_writer(checkpoint_writer), trace(trace), island_index(island_index), print_mutex(print_mutex)
+    {
+        TELEMETRY_ONLY(telemetry = NULL;)
+        report.closest.reserve(config.num_agents_per_gen);
+        reporter = std::thread(&GenerationReporter::reporter_loop, this);
+    }
+
+    /**
+     * @brief Finishes any queued report before returning
+     */
+    ~GenerationReporter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        reporter.join();
+    }
+
+    /**
+     * @brief Wait for the last report to finish
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&]
+                  { return !busy && !has_pending; });
+    }
+
+    /**
+     * @brief Start the report on an island's newest generation, waiting for the last report to finish first.
+     *
+     * The report is filled in from the island, anything else (checkpointing, allocations, a later best distance) can
+     * be set on it before 'submit'.
+     *
+     * @param island
+     * @param generation_number The generation the island just ranked
+     * @return GenerationReport& Only valid until 'submit'
+     */
+    GenerationReport &begin_report(Island &island, int generation_number)
+    {
+        wait();
+        report.generation = generation_number;
+        report.agents = &island.population.current();
+        report.closest = island.closest;
+        report.scenario = &island.scenarios[0];
+        report.best_distance = island.closest.at(0).distance;
+        report.mutation_chance = island.mutation_chance;
+        report.rng = generator;
+        report.goal = island.goal;
+        report.start = island.start;
+        report.draw = renderer && island.drawn && island.retention_for(generation_number) == FullHistory;
+        report.checkpoint = false;
+        report.allocations = 0;
+        return report;
+    }
+
+    /**
+     * @brief Hand the report over to the reporting thread, call from the thread running the generation loop
+     */
+    void submit()
+    {
+        TELEMETRY_ONLY(if (telemetry) report.telemetry = telemetry->take_sample(report.generation);)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            has_pending = true;
+        }
+        wake.notify_one();
+    }
+};
+/**
+ * @brief Evolve every island at once, each on its own thread, for the configured number of generations.
+ *
+ * The islands are joined in a ring: every migration_every_n_generations generations each island publishes its best
+ * agents and takes in whatever its neighbour last published. Islands never wait for each other, so a fast island
+ * may take in migrants from a few generations back. In deterministic mode they migrate in lockstep instead, see
+ * 'MigrationBarrier'. Each island reports on its generations through its own 'GenerationReporter'.
+ *
+ * @param islands The islands to evolve
+ * @param seed_rng Each island's generator is split from this, by island index
+ * @param renderer Handed the drawn island's generations, can be NULL
+ * @param trace Records every island's best distances, can be NULL
+ */
+void evolve_islands(std::vector<Island *> &islands, const Rng &seed_rng, Renderer *renderer, ReplayTrace *trace = NULL)
+{
+    int num_islands = islands.size();
+    int hardware_threads = config.num_threads > 0 ? config.num_threads : std::max(1u, std::thread::hardware_concurrency());
+    int threads_per_island = std::max(1, hardware_threads / num_islands);
+    std::mutex print_mutex;
+    MigrationBarrier barrier(num_islands);
+
+    auto run_island = [&](int island_i)
+    {
+        generator = seed_rng.split(island_i);
+        Island *island = islands[island_i];
+        MigrantExchange &neighbour = islands[(island_i + num_islands - 1) % num_islands]->outbox;
+        ThreadPool pool(threads_per_island);
+        int migration_every = config.migration_every_n_generations;
+
+        GenerationReporter reporter(renderer, NULL, trace, island_i, &print_mutex);
+
+        for (int generation = 0; generation < config.num_gen; generation++)
+        {
+            island->evolve(generation, pool);
+
+            // The Renderer is shown the generation as it was ranked, the printed distance includes any immigrants
+            GenerationReport &report = reporter.begin_report(*island, generation);
+            if (migration_every > 0 && (generation + 1) % migration_every == 0)
+            {
+                island->outbox.publish(island->closest);
+                if (config.deterministic)
+                    barrier.wait();
+                island->immigrate(neighbour);
+                if (config.deterministic)
+                    barrier.wait();
+                report.best_distance = island->closest.at(0).distance;
+            }
+            reporter.submit();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int island_i = 0; island_i < num_islands; island_i++)
+        threads.push_back(std::thread(run_island, island_i));
+    for (std::thread &thread : threads)
+        thread.join();
+}
+#endif
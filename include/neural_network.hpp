@@ -1,46 +1,46 @@
 #include <cstdlib>
 #include <bits/stdc++.h>
 #include "utils.hpp"
+#include "config.hpp"
+#include "runtime_config.hpp"
+#include "alloc_counter.hpp"
+#include "reproduction.hpp"
 
 #ifndef NEURALNET_H
 #define NEURALNET_H
 
-/**
- * @brief These are the different kinds of merge strategies when combining two Neural Networks
- *
- * EveryOther -> Every other weight will be picked from each Layer
- * SingleSplit -> A single index will be selected as the point to choose from Neural Network B
- * RandomChoice -> Each weight will be randomly chosen between the two
- */
-enum MergeType
-{
-    EveryOther,
-    SingleSplit,
-    RandomChoice
-};
-
 /**
  * @brief Used to construct a layer for a Neural Network
  *
+ * The biases are stored straight after the weights in the same allocation, so a layer's parameters can be merged,
+ * mutated and copied as one block.
  */
 struct Layer
 {
     int num_inputs;
     int num_neurons;
+    ActivationFunction activation;
     float *weights;
+    // Points just past the weights, NULL when the layer has no biases
+    float *biases;
 
     /**
      * @brief Construct a new Layer object
      *
      * @param num_neurons The number of neurons to put in the layer
      * @param num_inputs The number of inputs each neuron will have, basically the number of weights
+     * @param activation The function each neuron's output is run through
+     * @param has_biases Give every neuron a bias
+     * @param randomize Start with random weights, skipped when the weights are about to be overwritten by a merge
      */
-    Layer(int num_neurons, int num_inputs) : num_neurons(num_neurons), num_inputs(num_inputs)
+    Layer(int num_neurons, int num_inputs, ActivationFunction activation = SigmoidActivation, bool has_biases = false, bool randomize = true) : num_neurons(num_neurons), num_inputs(num_inputs), activation(activation)
     {
         // The total number of weights we will need is equal to the number of neurons * the number of weights.
-        weights = (float *)calloc(num_neurons * num_inputs, sizeof(float));
-        for (int weight = 0; weight < num_neurons * num_inputs; weight++)
-            weights[weight] = get_rand_uniform_float(-1.0, 1.0);
+        int num_parameters = num_neurons * num_inputs + (has_biases ? num_neurons : 0);
+        weights = (float *)counted_calloc(num_parameters, sizeof(float));
+        biases = has_biases ? weights + num_neurons * num_inputs : NULL;
+        if (randomize)
+            generator.fill_uniform(weights, num_parameters, -1.0, 1.0);
     }
     ~Layer()
     {
@@ -48,22 +48,24 @@ struct Layer
     }
 
     /**
-     * @brief Used to mutate the layers weights.
+     * @brief The number of weights and biases in the layer
      *
-     * @param mutation_chance A float to set the chance that determines the chance any weight might be mutated.
+     * @return int
      */
-    void mutate(float mutation_chance)
+    int num_parameters() const
     {
-        if (mutation_chance == 0)
-            return;
+        return num_neurons * num_inputs + (biases ? num_neurons : 0);
+    }
 
-        for (int weight = 0; weight < num_inputs * num_neurons; weight++)
-        {
-            if (get_rand_bool(mutation_chance))
-            {
-                weights[weight] = get_rand_uniform_float(-1.0, 1.0);
-            }
-        }
+    /**
+     * @brief Used to mutate the layers weights and biases.
+     *
+     * @param mutation_chance A float to set the chance that determines the chance any weight might be mutated.
+     * @param rng The generator to draw from, defaults to this thread's generator
+     */
+    void mutate(float mutation_chance, Rng &rng = generator)
+    {
+        mutate_weights(weights, num_parameters(), mutation_chance, rng);
     }
 
     /**
@@ -72,26 +74,45 @@ struct Layer
      * @param inputs This is assumed to be the same size as our initialized num_inputs.
      * @return float* This is what the layer has output, it is expected to be freed by the caller.
      */
-    float *calculate_outputs(float *inputs)
+    float *calculate_outputs(const float *inputs)
+    {
+        float *outputs = (float *)counted_calloc(num_neurons, sizeof(float));
+        calculate_outputs(inputs, outputs);
+        return outputs;
+    }
+
+    /**
+     * @brief Calculate what the layer would output with the given inputs, without allocating.
+     *
+     * @param inputs This is assumed to be the same size as our initialized num_inputs.
+     * @param outputs Where to write the layer's output, expected to be num_neurons long and not overlap inputs.
+     */
+    void calculate_outputs(const float *inputs, float *outputs)
     {
         /*
             Calculates the outputs of all neurons with the given inputs
         */
-        float *outputs = (float *)calloc(num_neurons, sizeof(float));
-
         for (int neuron_start_index = 0; neuron_start_index < num_inputs * num_neurons; neuron_start_index += num_inputs)
         {
             // This helps us know which neuron we are calculating for
             int current_neuron = neuron_start_index / num_inputs;
             // Set the proper neurons output using dot product
             outputs[current_neuron] = dot_product(inputs, weights + neuron_start_index, num_inputs);
-            outputs[current_neuron] = sigmoid(outputs[current_neuron]);
         }
-
-        return outputs;
+        if (biases)
+            for (int neuron = 0; neuron < num_neurons; neuron++)
+                outputs[neuron] += biases[neuron];
+        // Activate every neuron at once so the activation can be vectorized
+        activate_array(outputs, num_neurons, activation, config.use_fast_sigmoid);
     }
 };
 
+/**
+ * @brief A stack of any number of hidden layers followed by an output layer.
+ *
+ * Every layer can have its own activation. The forward pass ping-pongs between two halves of one scratch buffer sized
+ * for the widest hidden layer, so a deeper network costs no extra allocations, see 'predict'.
+ */
 struct NeuralNetwork
 {
 private:
@@ -103,68 +124,24 @@ private:
      */
     void merge_every_other(NeuralNetwork *a, NeuralNetwork *b)
     {
-        // Merge Hidden Layer
-        int num_weights = (hidden->num_neurons * hidden->num_inputs);
-        for (int weight_index = 0; weight_index < num_weights; weight_index++)
-        {
-            if (weight_index % 2 == 1)
-            {
-                hidden->weights[weight_index] = b->hidden->weights[weight_index];
-            }
-            else
-            {
-                hidden->weights[weight_index] = a->hidden->weights[weight_index];
-            }
-        }
-        // Merge Output Layer
-        num_weights = (output->num_neurons * output->num_inputs);
-        for (int weight_index = 0; weight_index < num_weights; weight_index++)
-        {
-            if (weight_index % 2 == 1)
-            {
-                output->weights[weight_index] = b->output->weights[weight_index];
-            }
-            else
-            {
-                output->weights[weight_index] = a->output->weights[weight_index];
-            }
-        }
+        for (size_t layer = 0; layer < layers.size(); layer++)
+            crossover_every_other(layers[layer]->weights, a->layers[layer]->weights, b->layers[layer]->weights, layers[layer]->num_parameters());
     }
     /**
      * @brief See 'MergeType' enum documentation for more information
      *
      * @param a Neural Network A
      * @param b Neural Network B
+     * @param rng The generator to pick the split points with
      */
-    void merge_single_split(NeuralNetwork *a, NeuralNetwork *b)
+    void merge_single_split(NeuralNetwork *a, NeuralNetwork *b, Rng &rng)
     {
-        // Merge Hidden Layer
-        int num_weights = (hidden->num_neurons * hidden->num_inputs);
-        int split_num = (int)get_rand_normal_float(num_weights / 2, 1);
-        for (int weight_index = 0; weight_index < num_weights; weight_index++)
-        {
-            if (weight_index < split_num)
-            {
-                hidden->weights[weight_index] = a->hidden->weights[weight_index];
-            }
-            else
-            {
-                hidden->weights[weight_index] = b->hidden->weights[weight_index];
-            }
-        }
-        // Merge Output Layer
-        num_weights = (output->num_neurons * output->num_inputs);
-        split_num = get_rand_int(0, num_weights - 1);
-        for (int weight_index = 0; weight_index < num_weights; weight_index++)
+        for (size_t layer = 0; layer < layers.size(); layer++)
         {
-            if (weight_index < split_num)
-            {
-                output->weights[weight_index] = a->output->weights[weight_index];
-            }
-            else
-            {
-                output->weights[weight_index] = b->output->weights[weight_index];
-            }
+            int num_weights = layers[layer]->num_parameters();
+            // Hidden layers split close to their middle, the output layer anywhere
+            int split_num = layer + 1 < layers.size() ? (int)get_rand_normal_float(num_weights / 2, 1, rng) : get_rand_int(0, num_weights - 1, rng);
+            crossover_single_split(layers[layer]->weights, a->layers[layer]->weights, b->layers[layer]->weights, num_weights, split_num);
         }
     }
     /**
@@ -172,52 +149,51 @@ private:
      *
      * @param a Neural Network A
      * @param b Neural Network B
+     * @param rng The generator to pick each weight's parent with
      */
-    void merge_random_choice(NeuralNetwork *a, NeuralNetwork *b)
+    void merge_random_choice(NeuralNetwork *a, NeuralNetwork *b, Rng &rng)
     {
-        // Merge Hidden Layer
-        int num_weights = (hidden->num_neurons * hidden->num_inputs);
-        for (int weight_index = 0; weight_index < num_weights; weight_index++)
-        {
-            if (get_rand_bool())
-            {
-                hidden->weights[weight_index] = a->hidden->weights[weight_index];
-            }
-            else
-            {
-                hidden->weights[weight_index] = b->hidden->weights[weight_index];
-            }
-        }
-        // Merge Output Layer
-        num_weights = (output->num_neurons * output->num_inputs);
-        for (int weight_index = 0; weight_index < num_weights; weight_index++)
+        for (size_t layer = 0; layer < layers.size(); layer++)
+            crossover_random_choice(layers[layer]->weights, a->layers[layer]->weights, b->layers[layer]->weights, layers[layer]->num_parameters(), rng);
+    }
+
+    /**
+     * @brief Create the layers, the last one is the output layer
+     */
+    void build(const std::vector<LayerShape> &shapes, bool has_biases, bool randomize)
+    {
+        int layer_inputs = num_inputs;
+        max_width = 0;
+        for (const LayerShape &shape : shapes)
         {
-            if (get_rand_bool())
-            {
-                output->weights[weight_index] = a->output->weights[weight_index];
-            }
-            else
-            {
-                output->weights[weight_index] = b->output->weights[weight_index];
-            }
+            layers.push_back(new Layer(shape.num_neurons, layer_inputs, shape.activation, has_biases, randomize));
+            layer_inputs = shape.num_neurons;
         }
+        for (size_t layer = 0; layer + 1 < layers.size(); layer++)
+            max_width = std::max(max_width, layers[layer]->num_neurons);
     }
 
 public:
-    Layer *hidden, *output;
-    int num_inputs, num_outputs, num_neurons;
+    // The hidden layers in order from the inputs, then the output layer
+    std::vector<Layer *> layers;
+    int num_inputs, num_outputs;
+    // The widest hidden layer, 0 without any
+    int max_width;
 
     /**
      * @brief Construct a new Neural Network object
      *
      * @param num_inputs Number of inputs to the Neural Network
      * @param num_outputs Number of outputs from the Neural Network
-     * @param num_neurons Number of neurons in the hidden layer
+     * @param hidden_layers The hidden layers in order from the inputs, can be empty
+     * @param output_activation The output layer's activation
+     * @param has_biases Give every neuron a bias
      */
-    NeuralNetwork(int num_inputs, int num_outputs, int num_neurons = 10) : num_neurons(num_neurons), num_inputs(num_inputs), num_outputs(num_outputs)
+    NeuralNetwork(int num_inputs, int num_outputs, const std::vector<LayerShape> &hidden_layers = config.hidden_layers, ActivationFunction output_activation = config.output_activation, bool has_biases = config.use_biases) : num_inputs(num_inputs), num_outputs(num_outputs)
     {
-        hidden = new Layer(num_neurons, num_inputs);
-        output = new Layer(num_outputs, num_neurons);
+        std::vector<LayerShape> shapes = hidden_layers;
+        shapes.push_back({num_outputs, output_activation});
+        build(shapes, has_biases, true);
     }
     /**
      * @brief Construct a new Neural Network object
@@ -228,40 +204,120 @@ public:
      * @param a Neural Network A
      * @param b Neural Network B
      * @param mt The Merge Strategy to use when merging based on the two input Neural Networks
+     * @param rng The generator to draw from, defaults to this thread's generator
      */
-    NeuralNetwork(NeuralNetwork *a, NeuralNetwork *b, MergeType mt) : num_neurons(a->num_neurons), num_inputs(a->num_inputs), num_outputs(a->num_outputs)
+    NeuralNetwork(NeuralNetwork *a, NeuralNetwork *b, MergeType mt, Rng &rng = generator) : num_inputs(a->num_inputs), num_outputs(a->num_outputs)
     {
         /*
             Merging two Neural Networks assumes they are identical in their layer shapes.
         */
-        hidden = new Layer(num_neurons, num_inputs);
-        output = new Layer(num_outputs, num_neurons);
+        build(a->layer_shapes(), a->layers[0]->biases != NULL, false);
+        merge(a, b, mt, rng);
+    }
+    ~NeuralNetwork()
+    {
+        for (Layer *layer : layers)
+            delete layer;
+    }
+
+    /**
+     * @brief The shape of every layer, the output layer included
+     *
+     * @return std::vector<LayerShape>
+     */
+    std::vector<LayerShape> layer_shapes() const
+    {
+        std::vector<LayerShape> shapes;
+        for (Layer *layer : layers)
+            shapes.push_back({layer->num_neurons, layer->activation});
+        return shapes;
+    }
+
+    /**
+     * @brief The number of weights and biases in every layer together
+     *
+     * @return int
+     */
+    int num_parameters() const
+    {
+        int total = 0;
+        for (Layer *layer : layers)
+            total += layer->num_parameters();
+        return total;
+    }
+
+    /**
+     * @brief Copy every layer's parameters out back to back, in layer order
+     *
+     * @param into Expected to be num_parameters long
+     */
+    void copy_parameters_to(float *into) const
+    {
+        for (Layer *layer : layers)
+        {
+            memcpy(into, layer->weights, layer->num_parameters() * sizeof(float));
+            into += layer->num_parameters();
+        }
+    }
+
+    /**
+     * @brief Overwrite every layer's parameters, laid out as 'copy_parameters_to' writes them
+     *
+     * @param from Expected to be num_parameters long
+     */
+    void copy_parameters_from(const float *from)
+    {
+        for (Layer *layer : layers)
+        {
+            memcpy(layer->weights, from, layer->num_parameters() * sizeof(float));
+            from += layer->num_parameters();
+        }
+    }
+
+    /**
+     * @brief The length of the scratch buffer 'predict' needs, room for two of the widest hidden layer
+     *
+     * @return int
+     */
+    int scratch_size() const
+    {
+        return 2 * max_width;
+    }
 
+    /**
+     * @brief Overwrite this Neural Network's weights with a merge of two others, only the given strategy is run.
+     *
+     * @param a Neural Network A
+     * @param b Neural Network B
+     * @param mt The Merge Strategy to use
+     * @param rng The generator to draw from, defaults to this thread's generator
+     */
+    void merge(NeuralNetwork *a, NeuralNetwork *b, MergeType mt, Rng &rng = generator)
+    {
         switch (mt)
         {
         case EveryOther:
             merge_every_other(a, b);
+            break;
         case SingleSplit:
-            merge_single_split(a, b);
+            merge_single_split(a, b, rng);
+            break;
         case RandomChoice:
-            merge_random_choice(a, b);
+            merge_random_choice(a, b, rng);
+            break;
         }
     }
-    ~NeuralNetwork()
-    {
-        delete (hidden);
-        delete (output);
-    }
 
     /**
      * @brief Mutate this Neural Network
      *
      * @param mutation_chance The chance any given weight will be mutated.
+     * @param rng The generator to draw from, defaults to this thread's generator
      */
-    void mutate(float mutation_chance)
+    void mutate(float mutation_chance, Rng &rng = generator)
     {
-        hidden->mutate(mutation_chance);
-        output->mutate(mutation_chance);
+        for (Layer *layer : layers)
+            layer->mutate(mutation_chance, rng);
     }
 
     /**
@@ -276,11 +332,33 @@ public:
             It is assumed the inputs array is the same length as 'num_inputs'
             in the constructor.
         */
-        float *hidden_out = hidden->calculate_outputs(inputs);
-        float *output_out = output->calculate_outputs(hidden_out);
-        free(hidden_out);
+        float *outputs = (float *)counted_calloc(num_outputs, sizeof(float));
+        float *scratch = (float *)counted_calloc(std::max(scratch_size(), 1), sizeof(float));
+        predict(inputs, outputs, scratch);
+        free(scratch);
+
+        return outputs;
+    }
 
-        return output_out;
+    /**
+     * @brief Given the inputs what would the neural network output, without allocating.
+     *
+     * Each hidden layer writes into the half of the scratch buffer the layer before it didn't, and the output layer
+     * writes straight into outputs.
+     *
+     * @param inputs The input to the Neural Network, expected to be the same length as num_inputs
+     * @param outputs Where to write the predictions, expected to be num_outputs long
+     * @param scratch Reusable space for the hidden layers' outputs, expected to be 'scratch_size' long
+     */
+    void predict(const float *inputs, float *outputs, float *scratch)
+    {
+        const float *layer_inputs = inputs;
+        for (size_t layer = 0; layer < layers.size(); layer++)
+        {
+            float *layer_outputs = layer + 1 == layers.size() ? outputs : scratch + (layer % 2) * max_width;
+            layers[layer]->calculate_outputs(layer_inputs, layer_outputs);
+            layer_inputs = layer_outputs;
+        }
     }
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,67 @@
+#include <vector>
+#include "agents.hpp"
+
+#ifndef POPULATION_H
+#define POPULATION_H
+
+/**
+ * @brief Two preallocated sets of Agents that swap roles every generation.
+ *
+ * While one buffer holds the generation being simulated and ranked, its offspring are bred in place into the other,
+ * then the two swap. Every Agent (and its Neural Network) is created once at startup and reused for the whole run.
+ */
+struct Population
+{
+    std::vector<Agent *> buffers[2];
+    int active;
+
+    /**
+     * @brief Construct a new Population object
+     *
+     * @param num_agents The number of agents in each generation
+     * @param start_pos The start position for every Agent
+     * @param num_sensors The number of sensors each Agent has
+     */
+    Population(int num_agents, Position start_pos, int num_sensors) : active(0)
+    {
+        for (int buffer = 0; buffer < 2; buffer++)
+            for (int agent_i = 0; agent_i < num_agents; agent_i++)
+                buffers[buffer].push_back(new Agent(start_pos, num_sensors));
+    }
+
+    ~Population()
+    {
+        for (int buffer = 0; buffer < 2; buffer++)
+            for (Agent *a : buffers[buffer])
+                delete a;
+    }
+
+    /**
+     * @brief The generation currently being simulated
+     *
+     * @return std::vector<Agent *>&
+     */
+    std::vector<Agent *> &current()
+    {
+        return buffers[active];
+    }
+
+    /**
+     * @brief The buffer the next generation should be bred into
+     *
+     * @return std::vector<Agent *>&
+     */
+    std::vector<Agent *> &next()
+    {
+        return buffers[1 - active];
+    }
+
+    /**
+     * @brief Make the freshly bred buffer the current generation
+     */
+    void swap()
+    {
+        active = 1 - active;
+    }
+};
+#endif
@@ -0,0 +1,474 @@
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "agents.hpp"
+#include "runtime_config.hpp"
+#include "scenario.hpp"
+#include "simulation.hpp"
+
+#ifdef _WIN32
+#define PROCESS_POOL_AVAILABLE 0
+#else
+#define PROCESS_POOL_AVAILABLE 1
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef PROCESS_POOL_H
+#define PROCESS_POOL_H
+
+/**
+ * @brief Sent from the master to a worker, asks it to evaluate agents [begin, end) or to quit
+ *
+ * Only the first scenario is sent, the worker builds the rest from it, see 'make_scenarios'.
+ */
+struct WorkerCommand
+{
+    int32_t quit;
+    int32_t begin, end;
+    float start_x, start_y;
+    float goal_x, goal_y;
+};
+
+/**
+ * @brief Sent back by a worker once its final positions are in the shared segment
+ */
+struct WorkerReply
+{
+    int32_t evaluated;
+};
+
+/**
+ * @brief Evaluates a population's fitness in forked worker processes.
+ *
+ * Every worker is forked at startup and attaches to one shared memory segment holding each agent's weights (written by
+ * the master after breeding) and final position in every scenario (written by the worker that evaluated it). Commands and replies go
+ * over a socket per worker, either a Unix socket pair or a TCP connection to localhost, which stands in for workers
+ * on other hosts. Each worker always gets the same contiguous slice of the population.
+ *
+ * A worker that dies, or doesn't reply within worker_timeout_seconds (stopped, deadlocked or stuck behind a slow
+ * connection), is dropped and its slice is evaluated in the master from then on, so a crash or a hang costs speed, not
+ * the run. This has to be created before any other thread is started, since only the forking thread survives a fork.
+ */
+struct ProcessPool
+{
+private:
+    int num_agents, num_scenarios, num_parameters;
+    // Shared with every worker: [agent][weight] and [agent][scenario][x, y]
+    float *weights, *results;
+    size_t segment_size;
+    std::vector<int> sockets;
+    std::vector<int> pids;
+
+    int agent_floats() const
+    {
+        return num_parameters;
+    }
+
+    int slice_begin(int worker, int count) const
+    {
+        return (long)count * worker / sockets.size();
+    }
+
+    static bool send_all(int fd, const void *data, size_t size)
+    {
+#if PROCESS_POOL_AVAILABLE
+        const char *bytes = (const char *)data;
+        while (size > 0)
+        {
+            ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+            if (sent <= 0)
+                return false;
+            bytes += sent;
+            size -= sent;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    static bool receive_all(int fd, void *data, size_t size)
+    {
+#if PROCESS_POOL_AVAILABLE
+        char *bytes = (char *)data;
+        while (size > 0)
+        {
+            ssize_t received = recv(fd, bytes, size, 0);
+            if (received <= 0)
+                return false;
+            bytes += received;
+            size -= received;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * @brief Make receives on the master's end of a socket give up after a while, 0 seconds waits forever
+     */
+    static void set_receive_timeout(int fd, int seconds)
+    {
+#if PROCESS_POOL_AVAILABLE
+        timeval timeout = {seconds, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+    }
+
+    /**
+     * @brief Stop using a worker, its slice is evaluated in the master from now on
+     */
+    void drop_worker(int worker)
+    {
+        std::cerr << "Worker " << worker << " stopped responding, evaluating its agents in this process" << std::endl;
+#if PROCESS_POOL_AVAILABLE
+        close(sockets[worker]);
+        if (pids[worker] > 0)
+        {
+            kill(pids[worker], SIGKILL);
+            waitpid(pids[worker], NULL, 0);
+        }
+#endif
+        sockets[worker] = -1;
+        pids[worker] = -1;
+    }
+
+    /**
+     * @brief The whole life of a worker process, never returns
+     *
+     * @param fd The worker's end of its socket
+     * @param shape Any agent with the population's Neural Network shape
+     */
+    void worker_main(int fd, Agent *shape)
+    {
+        // The worker's own copies of the agents, only ever given weights from the shared segment
+        std::vector<Agent *> agents;
+        for (int agent_i = 0; agent_i < num_agents; agent_i++)
+            agents.push_back(new Agent(Position(0, 0), shape->num_sensors));
+        PopulationNetwork network;
+        if (config.use_batched_inference)
+            shape_population(network, agents, num_scenarios);
+
+        WorkerCommand command;
+        while (receive_all(fd, &command, sizeof(command)) && !command.quit)
+        {
+            Position start(command.start_x, command.start_y), goal(command.goal_x, command.goal_y);
+            std::vector<Scenario> scenarios = make_scenarios(start, goal, num_scenarios, config.boundary_edge_length, config.num_obstacles, config.obstacle_radius, config.draw_object_size);
+            for (int agent_i = command.begin; agent_i < command.end; agent_i++)
+            {
+                Agent *agent = agents[agent_i];
+                const float *record = weights + (size_t)agent_i * agent_floats();
+                agent->nn->copy_parameters_from(record);
+                agent->reset(start, EndpointsOnly);
+            }
+
+            run_sim_range(agents, command.begin, command.end, scenarios, network);
+
+            for (int agent_i = command.begin; agent_i < command.end; agent_i++)
+            {
+                for (int scenario = 0; scenario < num_scenarios; scenario++)
+                {
+                    Position final_pos = agents[agent_i]->scenario_position(scenario);
+                    float *result = results + (agent_i * num_scenarios + scenario) * 2;
+                    result[0] = final_pos.x;
+                    result[1] = final_pos.y;
+                }
+            }
+            WorkerReply reply = {command.end - command.begin};
+            if (!send_all(fd, &reply, sizeof(reply)))
+                break;
+        }
+#if PROCESS_POOL_AVAILABLE
+        // Skip the master's destructors and exit handlers, they are not ours to run
+        _exit(0);
+#endif
+    }
+
+    /**
+     * @brief Fork a worker, returns in the master only
+     *
+     * @param worker The worker's index
+     * @param master_fd Set to the master's end of the worker's socket, -1 when the worker could not be started
+     * @param tcp_port When not 0 the worker connects to this localhost port instead of using a socket pair
+     * @param listener The master's listening socket in TCP mode, otherwise -1
+     * @param shape Any agent with the population's Neural Network shape
+     */
+    void spawn_worker(int worker, int &master_fd, int tcp_port, int listener, Agent *shape)
+    {
+        master_fd = -1;
+#if PROCESS_POOL_AVAILABLE
+        int pair[2] = {-1, -1};
+        if (!tcp_port && socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+            return;
+
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            if (!tcp_port)
+            {
+                close(pair[0]);
+                close(pair[1]);
+            }
+            return;
+        }
+
+        if (pid == 0)
+        {
+#ifdef __linux__
+            if (config.pin_worker_processes)
+            {
+                // One core per worker, so a worker's memory stays on its core's NUMA node
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(worker % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+                sched_setaffinity(0, sizeof(cpus), &cpus);
+            }
+#endif
+            // Only keep our own socket, an inherited one would stop the master noticing when a sibling dies
+            for (int fd : sockets)
+                if (fd >= 0)
+                    close(fd);
+            if (listener >= 0)
+                close(listener);
+
+            int fd = pair[1];
+            if (tcp_port)
+            {
+                fd = socket(AF_INET, SOCK_STREAM, 0);
+                sockaddr_in address;
+                memset(&address, 0, sizeof(address));
+                address.sin_family = AF_INET;
+                address.sin_port = htons(tcp_port);
+                address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                int32_t index = worker;
+                if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof(address)) != 0 || !send_all(fd, &index, sizeof(index)))
+                    _exit(1);
+            }
+            else
+            {
+                close(pair[0]);
+            }
+            worker_main(fd, shape);
+        }
+
+        pids[worker] = pid;
+        if (!tcp_port)
+        {
+            close(pair[1]);
+            master_fd = pair[0];
+            set_receive_timeout(master_fd, config.worker_timeout_seconds);
+        }
+#endif
+    }
+
+public:
+    /**
+     * @brief Construct a new Process Pool object and start its workers
+     *
+     * @param num_workers The number of worker processes
+     * @param shape Any agent with the population's Neural Network shape, every agent is expected to share it
+     * @param num_agents The number of agents in each generation
+     * @param use_tcp Talk to the workers over localhost TCP rather than Unix socket pairs
+     * @param num_scenarios The number of scenarios every generation is evaluated on
+     */
+    ProcessPool(int num_workers, Agent *shape, int num_agents, bool use_tcp = false, int num_scenarios = 1) : num_agents(num_agents), num_scenarios(num_scenarios), weights(NULL), results(NULL), segment_size(0)
+    {
+        num_parameters = shape->nn->num_parameters();
+        sockets.assign(num_workers, -1);
+        pids.assign(num_workers, -1);
+
+#if PROCESS_POOL_AVAILABLE
+        segment_size = ((size_t)num_agents * agent_floats() + (size_t)num_agents * num_scenarios * 2) * sizeof(float);
+        void *segment = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (segment == MAP_FAILED)
+        {
+            std::cerr << "Could not create the shared segment, evaluating in this process" << std::endl;
+            return;
+        }
+        weights = (float *)segment;
+        results = weights + (size_t)num_agents * agent_floats();
+
+        int listener = -1, tcp_port = 0;
+        if (use_tcp)
+        {
+            listener = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address;
+            memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t length = sizeof(address);
+            if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, num_workers) != 0 ||
+                getsockname(listener, (sockaddr *)&address, &length) != 0)
+            {
+                std::cerr << "Could not listen on localhost, evaluating in this process" << std::endl;
+                if (listener >= 0)
+                    close(listener);
+                return;
+            }
+            tcp_port = ntohs(address.sin_port);
+            // Don't wait forever on a worker that never manages to connect
+            set_receive_timeout(listener, 10);
+        }
+
+        for (int worker = 0; worker < num_workers; worker++)
+            spawn_worker(worker, sockets[worker], tcp_port, listener, shape);
+
+        if (use_tcp)
+        {
+            // Workers say who they are first, they can connect in any order
+            for (int worker = 0; worker < num_workers; worker++)
+            {
+                if (pids[worker] < 0)
+                    continue;
+                int fd = accept(listener, NULL, NULL);
+                int32_t index = -1;
+                if (fd < 0)
+                    break;
+                int no_delay = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+                set_receive_timeout(fd, config.worker_timeout_seconds);
+                if (receive_all(fd, &index, sizeof(index)) && index >= 0 && index < num_workers && sockets[index] < 0)
+                    sockets[index] = fd;
+                else
+                    close(fd);
+            }
+            close(listener);
+        }
+#endif
+    }
+
+    ~ProcessPool()
+    {
+        WorkerCommand quit;
+        memset(&quit, 0, sizeof(quit));
+        quit.quit = 1;
+#if PROCESS_POOL_AVAILABLE
+        for (size_t worker = 0; worker < sockets.size(); worker++)
+        {
+            if (sockets[worker] >= 0)
+            {
+                send_all(sockets[worker], &quit, sizeof(quit));
+                close(sockets[worker]);
+            }
+            if (pids[worker] > 0)
+                waitpid(pids[worker], NULL, 0);
+        }
+        if (weights)
+            munmap(weights, segment_size);
+#endif
+    }
+
+    /**
+     * @brief The process id of a worker
+     *
+     * @param worker
+     * @return int -1 once the worker has been dropped, or when it could not be started
+     */
+    int worker_pid(int worker) const
+    {
+        return pids[worker];
+    }
+
+    /**
+     * @brief The number of workers still alive
+     *
+     * @return int
+     */
+    int live_workers() const
+    {
+        int live = 0;
+        for (int fd : sockets)
+            live += fd >= 0;
+        return live;
+    }
+
+    /**
+     * @brief Run a whole generation, the worker processes' stand-in for 'run_sim'.
+     *
+     * Afterwards each Agent's path ends at its final position, the steps in between are not kept.
+     *
+     * @param agents The agents to simulate, already reset to the first scenario's start, at most num_agents of them
+     * @param scenarios The scenarios to run, num_scenarios long and built by 'make_scenarios'
+     * @param population Used to evaluate the slices of workers that have died
+     */
+    void run_sim(std::vector<Agent *> &agents, const std::vector<Scenario> &scenarios, PopulationNetwork &population)
+    {
+        int num_workers = sockets.size();
+        if (agents.empty())
+            return;
+        if (!weights || live_workers() == 0)
+        {
+            ThreadPool serial(1);
+            ::run_sim(agents, scenarios, population, serial);
+            return;
+        }
+
+        int count = agents.size();
+        for (int agent_i = 0; agent_i < count; agent_i++)
+        {
+            agents[agent_i]->nn->copy_parameters_to(weights + (size_t)agent_i * agent_floats());
+        }
+
+        WorkerCommand command;
+        memset(&command, 0, sizeof(command));
+        command.start_x = scenarios[0].start.x;
+        command.start_y = scenarios[0].start.y;
+        command.goal_x = scenarios[0].goal.x;
+        command.goal_y = scenarios[0].goal.y;
+        for (int worker = 0; worker < num_workers; worker++)
+        {
+            command.begin = slice_begin(worker, count);
+            command.end = slice_begin(worker + 1, count);
+            if (sockets[worker] >= 0 && !send_all(sockets[worker], &command, sizeof(command)))
+                drop_worker(worker);
+        }
+
+        bool reshaped = false;
+        for (int worker = 0; worker < num_workers; worker++)
+        {
+            int begin = slice_begin(worker, count), end = slice_begin(worker + 1, count);
+            WorkerReply reply;
+            if (sockets[worker] >= 0 && receive_all(sockets[worker], &reply, sizeof(reply)) && reply.evaluated == end - begin)
+            {
+                for (int agent_i = begin; agent_i < end; agent_i++)
+                {
+                    agents[agent_i]->reset_scenarios(scenarios);
+                    for (int scenario = 0; scenario < num_scenarios; scenario++)
+                    {
+                        const float *result = results + (agent_i * num_scenarios + scenario) * 2;
+                        agents[agent_i]->finish_scenario(scenario, Position(result[0], result[1]));
+                    }
+                }
+                continue;
+            }
+
+            // The worker is gone, take over its slice
+            if (sockets[worker] >= 0)
+                drop_worker(worker);
+            if (!reshaped && config.use_batched_inference)
+                shape_population(population, agents, num_scenarios);
+            reshaped = true;
+            run_sim_range(agents, begin, end, scenarios, population);
+        }
+    }
+};
+#endif
@@ -0,0 +1,288 @@
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <SFML/Graphics.hpp>
+#include "agents.hpp"
+#include "config.hpp"
+#include "runtime_config.hpp"
+#include "scenario.hpp"
+
+#ifndef RENDERER_H
+#define RENDERER_H
+
+/**
+ * @brief Bounded single producer / single consumer queue, neither side ever takes a lock or waits.
+ *
+ * @tparam T The (small, copyable) item type
+ * @tparam Capacity Must be a power of two
+ */
+template <typename T, unsigned Capacity>
+struct SpscQueue
+{
+    T items[Capacity];
+    std::atomic<unsigned> head, tail;
+
+    SpscQueue() : head(0), tail(0) {}
+
+    /**
+     * @brief Only call from the producer thread
+     *
+     * @param item
+     * @return true
+     * @return false The queue was full and the item was not added
+     */
+    bool push(T item)
+    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == Capacity)
+            return false;
+        items[t & (Capacity - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Only call from the consumer thread
+     *
+     * @param item Set to the oldest item when there is one
+     * @return true
+     * @return false The queue was empty
+     */
+    bool pop(T &item)
+    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = items[h & (Capacity - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+/**
+ * @brief Everything the viewer needs to play back one generation, copied out so evolution can carry on straight away.
+ *
+ * Paths are stored agent-major ([agent][move]), the top performer is always agent 0.
+ */
+struct GenerationSnapshot
+{
+    int generation_number;
+    Position goal;
+    std::vector<Position> obstacles;
+    float obstacle_radius;
+    int num_agents, num_moves;
+    std::vector<float> xs, ys;
+
+    GenerationSnapshot() : generation_number(0), goal(0, 0), obstacle_radius(0), num_agents(0), num_moves(0) {}
+};
+
+/**
+ * @brief Plays back generations in an SFML window on its own thread.
+ *
+ * The evolution loop hands over snapshots with 'submit', which never blocks: snapshots live in a fixed set of slots
+ * that travel between the two threads through a pair of lock-free queues. If every slot is busy the new snapshot is
+ * dropped, and when several snapshots are waiting the viewer skips straight to the newest one.
+ */
+struct Renderer
+{
+private:
+    GenerationSnapshot slots[RENDER_SNAPSHOT_SLOTS];
+    // Slots ready for the evolution loop to fill, and filled slots waiting to be shown
+    SpscQueue<GenerationSnapshot *, 8> free_slots, ready;
+    std::atomic<bool> stopping, finishing;
+    std::thread viewer;
+
+    /**
+     * @brief Draw a single move of a snapshot
+     */
+    void draw_move(sf::RenderWindow &window, sf::RectangleShape &shape, sf::CircleShape &obstacle, GenerationSnapshot *snapshot, int move)
+    {
+        shape.setSize(sf::Vector2f(config.draw_object_size, config.draw_object_size));
+        window.clear(sf::Color::Black);
+
+        // Draw the obstacles, positioned by their centre
+        obstacle.setRadius(snapshot->obstacle_radius);
+        obstacle.setFillColor(sf::Color(96, 96, 96));
+        for (const Position &centre : snapshot->obstacles)
+        {
+            obstacle.setPosition(sf::Vector2f(centre.x - snapshot->obstacle_radius, centre.y - snapshot->obstacle_radius));
+            window.draw(obstacle);
+        }
+
+        // Draw our Goal
+        shape.setFillColor(sf::Color::Yellow);
+        shape.setPosition(sf::Vector2f(snapshot->goal.x, snapshot->goal.y));
+        window.draw(shape);
+
+        // Draw our Agents
+        shape.setFillColor(sf::Color::Red);
+        for (int agent = 0; agent < snapshot->num_agents; agent++)
+        {
+            int index = agent * snapshot->num_moves + move;
+            shape.setPosition(sf::Vector2f(snapshot->xs[index], snapshot->ys[index]));
+            window.draw(shape);
+        }
+
+        // Re-Draw the top performer
+        shape.setFillColor(sf::Color::Green);
+        shape.setPosition(sf::Vector2f(snapshot->xs[move], snapshot->ys[move]));
+        window.draw(shape);
+
+        window.display();
+    }
+
+    void viewer_loop()
+    {
+        sf::RenderWindow window;
+        sf::RectangleShape shape;
+        sf::CircleShape obstacle;
+        sf::Clock clock;
+        GenerationSnapshot *showing = NULL, *newest;
+        int move = 0;
+
+        while (!stopping.load())
+        {
+            // Coalesce, only the newest waiting snapshot is worth showing
+            while (ready.pop(newest))
+            {
+                if (showing)
+                    free_slots.push(showing);
+                showing = newest;
+                move = 0;
+
+                std::string title = "Generation " + std::to_string(showing->generation_number);
+                if (window.isOpen())
+                    window.setTitle(title);
+                else
+                    window.create(sf::VideoMode(config.boundary_edge_length, config.boundary_edge_length), title);
+            }
+
+            if (!showing || !window.isOpen())
+            {
+                // Closing the window skips the rest of that generation, the next snapshot opens a new one
+                if (showing)
+                {
+                    free_slots.push(showing);
+                    showing = NULL;
+                }
+                if (finishing.load())
+                    return;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+
+            draw_move(window, shape, obstacle, showing, move);
+            // Keep replaying the generation until a newer one arrives or the window is closed
+            move = (move + 1) % showing->num_moves;
+
+            sf::Event event;
+            while (window.pollEvent(event))
+            {
+                if (event.type == sf::Event::Closed)
+                    window.close();
+            }
+
+            // Sleep out the rest of the frame rather than spinning, this thread shares the machine with evolution
+            float frame_left = config.draw_seconds_per_frame - clock.getElapsedTime().asSeconds();
+            if (frame_left > 0)
+                std::this_thread::sleep_for(std::chrono::duration<float>(frame_left));
+            clock.restart();
+        }
+    }
+
+public:
+    std::atomic<unsigned long> submitted, dropped;
+
+    /**
+     * @brief Construct a new Renderer object and start the viewer thread
+     *
+     * @param max_agents The most agents a snapshot will hold
+     * @param max_moves The most moves a snapshot will hold
+     */
+    Renderer(int max_agents, int max_moves) : stopping(false), finishing(false), submitted(0), dropped(0)
+    {
+        // Sized up front so taking a snapshot never allocates
+        for (int slot = 0; slot < RENDER_SNAPSHOT_SLOTS; slot++)
+        {
+            slots[slot].xs.reserve(max_agents * max_moves);
+            slots[slot].ys.reserve(max_agents * max_moves);
+            free_slots.push(&slots[slot]);
+        }
+        viewer = std::thread(&Renderer::viewer_loop, this);
+    }
+
+    ~Renderer()
+    {
+        stopping = true;
+        if (viewer.joinable())
+            viewer.join();
+    }
+
+    /**
+     * @brief Hand a generation to the viewer, never blocks.
+     *
+     * @param agents Every agent in the generation, used with draw_full_population
+     * @param closest The ranked agents, best first
+     * @param scenario The scenario that is drawn, its goal and obstacles
+     * @param generation_number
+     * @return true
+     * @return false The viewer was still busy with older snapshots and this one was dropped
+     */
+    bool submit(std::vector<Agent *> &agents, std::vector<AgentDistancePair> &closest, const Scenario &scenario, int generation_number)
+    {
+        submitted++;
+        GenerationSnapshot *snapshot;
+        if (!free_slots.pop(snapshot))
+        {
+            dropped++;
+            return false;
+        }
+
+        Agent *best = closest.at(0).agent;
+        snapshot->generation_number = generation_number;
+        snapshot->goal = scenario.goal;
+        // The same every generation, so after the first snapshot this reuses the slot's storage
+        snapshot->obstacles = scenario.obstacles;
+        snapshot->obstacle_radius = scenario.obstacle_radius;
+        snapshot->num_moves = best->path.size();
+        snapshot->num_agents = 0;
+        snapshot->xs.clear();
+        snapshot->ys.clear();
+
+        auto add_agent = [&](Agent *agent)
+        {
+            snapshot->xs.insert(snapshot->xs.end(), agent->path.xs.begin(), agent->path.xs.begin() + snapshot->num_moves);
+            snapshot->ys.insert(snapshot->ys.end(), agent->path.ys.begin(), agent->path.ys.begin() + snapshot->num_moves);
+            snapshot->num_agents++;
+        };
+
+        add_agent(best);
+        if (config.draw_full_population)
+        {
+            for (Agent *agent : agents)
+                if (agent != best)
+                    add_agent(agent);
+        }
+        else
+        {
+            for (size_t rank = 1; rank < closest.size(); rank++)
+                add_agent(closest[rank].agent);
+        }
+
+        ready.push(snapshot);
+        return true;
+    }
+
+    /**
+     * @brief Called at the end of a run, lets the viewer keep playing until its window is closed.
+     */
+    void finish()
+    {
+        finishing = true;
+        if (viewer.joinable())
+            viewer.join();
+    }
+};
+#endif
@@ -0,0 +1,122 @@
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include "utils.hpp"
+
+#ifndef REPRODUCTION_H
+#define REPRODUCTION_H
+
+/**
+ * @brief These are the different kinds of merge strategies when combining two Neural Networks
+ *
+ * EveryOther -> Every other weight will be picked from each Layer
+ * SingleSplit -> A single index will be selected as the point to choose from Neural Network B
+ * RandomChoice -> Each weight will be randomly chosen between the two
+ */
+enum MergeType
+{
+    EveryOther,
+    SingleSplit,
+    RandomChoice
+};
+
+/**
+ * @brief Crossover kernels work on whole contiguous weight blocks (one Layer at a time) with no per-weight branches,
+ * so they compile down to copies, blends and masked selects.
+ */
+
+/**
+ * @brief Even weights come from a, odd weights from b
+ *
+ * @param child Where to write the merged weights
+ * @param a Parent A's weights
+ * @param b Parent B's weights
+ * @param length Number of weights in each block
+ */
+void crossover_every_other(float *child, const float *a, const float *b, int length)
+{
+    int weight = 0;
+    for (; weight + 2 <= length; weight += 2)
+    {
+        child[weight] = a[weight];
+        child[weight + 1] = b[weight + 1];
+    }
+    if (weight < length)
+        child[weight] = a[weight];
+}
+
+/**
+ * @brief Weights before the split come from a, the rest from b
+ *
+ * @param child Where to write the merged weights
+ * @param a Parent A's weights
+ * @param b Parent B's weights
+ * @param length Number of weights in each block
+ * @param split Index of the first weight taken from b, clamped to the block
+ */
+void crossover_single_split(float *child, const float *a, const float *b, int length, int split)
+{
+    split = std::max(0, std::min(split, length));
+    memcpy(child, a, split * sizeof(float));
+    memcpy(child + split, b + split, (length - split) * sizeof(float));
+}
+
+/**
+ * @brief Each weight comes from a or b with equal chance
+ *
+ * One 64 bit draw covers 64 weights, each bit selecting which parent the weight is taken from.
+ *
+ * @param child Where to write the merged weights
+ * @param a Parent A's weights
+ * @param b Parent B's weights
+ * @param length Number of weights in each block
+ * @param rng The generator to draw the selection mask from
+ */
+void crossover_random_choice(float *child, const float *a, const float *b, int length, Rng &rng)
+{
+    for (int chunk_start = 0; chunk_start < length; chunk_start += 64)
+    {
+        uint64_t take_a = rng.next();
+        int chunk_length = std::min(64, length - chunk_start);
+        for (int weight = 0; weight < chunk_length; weight++)
+        {
+            int index = chunk_start + weight;
+            child[index] = ((take_a >> weight) & 1) ? a[index] : b[index];
+        }
+    }
+}
+
+/**
+ * @brief Replace each weight with a new uniform random weight with the given chance
+ *
+ * Instead of a draw per weight, the gap to the next mutated weight is drawn from the matching geometric distribution,
+ * so the number of draws is proportional to the number of mutations (roughly mutation_chance * length) rather than
+ * the number of weights.
+ *
+ * @param weights The weights to mutate
+ * @param length Number of weights
+ * @param mutation_chance The chance any given weight will be mutated
+ * @param rng The generator to draw from
+ */
+void mutate_weights(float *weights, int length, float mutation_chance, Rng &rng)
+{
+    if (mutation_chance <= 0)
+        return;
+    if (mutation_chance >= 1)
+    {
+        rng.fill_uniform(weights, length, -1.0, 1.0);
+        return;
+    }
+
+    float log_keep = log1pf(-mutation_chance);
+    for (int weight = 0;; weight++)
+    {
+        // 1 - uniform() is in (0, 1] so the log is always finite, checking as a float first avoids overflowing the int
+        float skip = logf(1.0f - rng.uniform()) / log_keep;
+        if (skip >= length - weight)
+            return;
+        weight += (int)skip;
+        weights[weight] = rng.uniform(-1.0, 1.0);
+    }
+}
+#endif
@@ -0,0 +1,178 @@
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include "telemetry.hpp"
+
+#ifndef RNG_H
+#define RNG_H
+
+/**
+ * @brief One step of splitmix64, used to expand seeds and to mix stream ids into independent states.
+ *
+ * @param state Advanced in place
+ * @return uint64_t
+ */
+uint64_t splitmix64(uint64_t &state)
+{
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/**
+ * @brief xoshiro256** random number generator.
+ *
+ * Small (32 bytes of state), fast, and cheap to split into independent streams: 'split' derives a new generator from
+ * this one's state and a stream id, so the same seed and id always give the same stream no matter which thread asks.
+ * Satisfies UniformRandomBitGenerator so it can still drive the std:: distributions.
+ */
+struct Rng
+{
+    uint64_t state[4];
+
+    typedef uint64_t result_type;
+    static constexpr uint64_t min() { return 0; }
+    static constexpr uint64_t max() { return UINT64_MAX; }
+
+    /**
+     * @brief Construct a new Rng object
+     *
+     * @param seed_value Any value, expanded into the full state with splitmix64
+     */
+    Rng(uint64_t seed_value = 0x5EED5EED5EED5EEDull)
+    {
+        seed(seed_value);
+    }
+
+    void seed(uint64_t seed_value)
+    {
+        for (int i = 0; i < 4; i++)
+            state[i] = splitmix64(seed_value);
+    }
+
+    uint64_t operator()()
+    {
+        return next();
+    }
+
+    uint64_t next()
+    {
+        TELEMETRY_COUNT_THREAD(CounterRngDraws);
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    /**
+     * @brief Advance the generator by 2^128 draws, the classic way of handing out non-overlapping sequences.
+     */
+    void jump()
+    {
+        static const uint64_t JUMP[] = {0x180EC6D33CFD0ABAull, 0xD5A61266F0C9392Cull, 0xA9582618E03FC9AAull, 0x39ABDC4529B1661Cull};
+        uint64_t s[4] = {0, 0, 0, 0};
+        for (int i = 0; i < 4; i++)
+            for (int b = 0; b < 64; b++)
+            {
+                if (JUMP[i] & (1ull << b))
+                    for (int w = 0; w < 4; w++)
+                        s[w] ^= state[w];
+                next();
+            }
+        memcpy(state, s, sizeof(state));
+    }
+
+    /**
+     * @brief Derive an independent generator for the given stream, without advancing this one.
+     *
+     * @param stream Any id, e.g. a thread or agent index
+     * @return Rng
+     */
+    Rng split(uint64_t stream) const
+    {
+        uint64_t mix = stream * 0xD1B54A32D192ED03ull;
+        for (int i = 0; i < 4; i++)
+            mix ^= splitmix64(mix) + state[i];
+        return Rng(mix);
+    }
+
+    /**
+     * @brief Uniform float in [0, 1), from the top 24 bits so every value is exactly representable
+     *
+     * @return float
+     */
+    float uniform()
+    {
+        return (next() >> 40) * (1.0f / 16777216.0f);
+    }
+
+    float uniform(float from, float to)
+    {
+        return from + uniform() * (to - from);
+    }
+
+    /**
+     * @brief Fill an array with uniform floats between from and to
+     *
+     * @param values The array to fill
+     * @param length The length of the array
+     * @param from
+     * @param to
+     */
+    void fill_uniform(float *values, int length, float from, float to)
+    {
+        float scale = (to - from) * (1.0f / 16777216.0f);
+        for (int i = 0; i < length; i++)
+            values[i] = from + (next() >> 40) * scale;
+    }
+
+    /**
+     * @brief Fill an array with 0 / 1 values, each 1 with the given chance
+     *
+     * The chance is turned into a 32 bit threshold once, so every entry is a single compare and each draw covers two
+     * entries.
+     *
+     * @param mask The array to fill
+     * @param length The length of the array
+     * @param chance The chance of any entry being 1 (must be between 0-1)
+     */
+    void fill_mask(uint8_t *mask, int length, float chance)
+    {
+        uint64_t threshold = (uint64_t)(chance * 4294967296.0);
+        int i = 0;
+        for (; i + 2 <= length; i += 2)
+        {
+            uint64_t bits = next();
+            mask[i] = (bits & 0xFFFFFFFFull) < threshold;
+            mask[i + 1] = (bits >> 32) < threshold;
+        }
+        if (i < length)
+            mask[i] = (next() & 0xFFFFFFFFull) < threshold;
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+/**
+ * @brief Hands out a distinct default seed to each thread's generator
+ */
+std::atomic<uint64_t> next_thread_seed(0x5EED5EED5EED5EEDull);
+
+/**
+ * @brief Used for randomness
+ *
+ * Every thread gets its own generator so drawing never needs a lock. Threads that need reproducible results should
+ * seed it, or use a 'split' stream, instead of relying on the default seed.
+ */
+thread_local Rng generator(next_thread_seed.fetch_add(0x9E3779B97F4A7C15ull));
+#endif
@@ -0,0 +1,509 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "config.hpp"
+#include "reproduction.hpp"
+#include "scenario.hpp"
+#include "simd.hpp"
+#include "utils.hpp"
+
+#ifndef RUNTIME_CONFIG_H
+#define RUNTIME_CONFIG_H
+
+/**
+ * @brief The kinds of value a configuration option can hold
+ */
+enum ConfigValueType
+{
+    ConfigInt,
+    ConfigUInt64,
+    ConfigFloat,
+    ConfigDouble,
+    ConfigBool,
+    ConfigString,
+    ConfigMergeType,
+    ConfigFitnessReduction,
+    ConfigWeightPrecision,
+    ConfigActivationFunction,
+    ConfigLayerShapes
+};
+
+/**
+ * @brief A single named setting, pointing at the Config member it controls
+ */
+struct ConfigOption
+{
+    const char *name;
+    ConfigValueType type;
+    void *value;
+    const char *description;
+};
+
+/**
+ * @brief Every setting that can be changed without recompiling.
+ *
+ * Defaults come from the macros in config.hpp. They can be overridden from a file of 'name = value' lines (with '#'
+ * comments) given with --config=<path>, then from --name=value flags, which are applied in order. Bool flags can be
+ * given without a value to switch them on. Values are meant to be read once into locals outside of hot loops.
+ *
+ * Settings that size fixed storage (RENDER_SNAPSHOT_SLOTS) or change what gets compiled (COUNT_ALLOCATIONS) stay
+ * compile time only.
+ */
+struct Config
+{
+    // World controls
+    float boundary_edge_length;
+    int num_obstacles;
+    float obstacle_radius;
+    int num_sensed_neighbours;
+    float sensing_radius;
+    // Network controls, the hidden layers in order from the inputs
+    std::vector<LayerShape> hidden_layers;
+    ActivationFunction output_activation;
+    bool use_biases;
+    // Mutation controls
+    double max_mutation_chance, mutation_chance_c_value;
+    float mutation_chance_limit;
+    MergeType merge_strategy;
+    // Generation controls
+    int num_gen, num_ticks_per_gen, num_agents_per_gen, num_agents_selected_each_generation;
+    // Fitness controls
+    int num_scenarios;
+    FitnessReduction fitness_reduction;
+    // Display options
+    bool print_generation_performance, draw_generation_performance;
+    float draw_seconds_per_frame, draw_object_size;
+    int draw_every_nth_generation;
+    bool draw_full_population;
+    // Island options
+    int num_islands, migration_every_n_generations, num_migrants;
+    // Worker process options
+    int num_worker_processes;
+    bool worker_use_tcp, pin_worker_processes;
+    int worker_timeout_seconds;
+    // Checkpoint options
+    int checkpoint_every_n_generations;
+    std::string checkpoint_path;
+    bool resume_from_checkpoint;
+    // Replay options
+    uint64_t seed;
+    bool deterministic;
+    std::string trace_path;
+    bool verify_trace;
+    // Telemetry options, only used when ENABLE_TELEMETRY is compiled in
+    std::string telemetry_path;
+    // Performance options
+    bool use_batched_inference, early_exit_settled_agents;
+    WeightPrecision weight_precision;
+    int num_threads;
+    bool use_fast_sigmoid, use_fixed_topology_network;
+    int fitness_cache_size;
+
+    Config() : boundary_edge_length(BOUNDARY_EDGE_LENGTH), num_obstacles(NUM_OBSTACLES), obstacle_radius(OBSTACLE_RADIUS),
+               num_sensed_neighbours(NUM_SENSED_NEIGHBOURS), sensing_radius(SENSING_RADIUS),
+               output_activation(OUTPUT_ACTIVATION), use_biases(USE_BIASES),
+               max_mutation_chance(MAX_MUTATION_CHANCE), mutation_chance_c_value(MUTATION_CHANCE_C_VALUE),
+               mutation_chance_limit(MUTATION_CHANCE_LIMIT), merge_strategy(AGENT_MERGE_STRATEGY),
+               num_gen(NUM_GEN), num_ticks_per_gen(NUM_TICKS_PER_GEN), num_agents_per_gen(NUM_AGENTS_PER_GEN),
+               num_agents_selected_each_generation(NUM_AGENTS_SELECTED_EACH_GENERATION),
+               num_scenarios(NUM_SCENARIOS), fitness_reduction(FITNESS_REDUCTION),
+               print_generation_performance(PRINT_GENERATION_PERFORMANCE), draw_generation_performance(DRAW_GENERATION_PERFORMANCE),
+               draw_seconds_per_frame(DRAW_SECONDS_PER_FRAME), draw_object_size(DRAW_OBJECT_SIZE),
+               draw_every_nth_generation(DRAW_EVERY_NTH_GENERATION), draw_full_population(DRAW_FULL_POPULATION),
+               num_islands(NUM_ISLANDS), migration_every_n_generations(MIGRATION_EVERY_N_GENERATIONS), num_migrants(NUM_MIGRANTS),
+               num_worker_processes(NUM_WORKER_PROCESSES), worker_use_tcp(WORKER_USE_TCP), pin_worker_processes(PIN_WORKER_PROCESSES),
+               worker_timeout_seconds(WORKER_TIMEOUT_SECONDS),
+               checkpoint_every_n_generations(CHECKPOINT_EVERY_N_GENERATIONS), checkpoint_path(CHECKPOINT_PATH),
+               resume_from_checkpoint(RESUME_FROM_CHECKPOINT),
+               seed(SEED), deterministic(DETERMINISTIC), trace_path(TRACE_PATH), verify_trace(VERIFY_TRACE),
+               telemetry_path(TELEMETRY_PATH),
+               use_batched_inference(USE_BATCHED_INFERENCE), early_exit_settled_agents(EARLY_EXIT_SETTLED_AGENTS),
+               weight_precision(WEIGHT_PRECISION),
+               num_threads(NUM_THREADS), use_fast_sigmoid(USE_FAST_SIGMOID), use_fixed_topology_network(USE_FIXED_TOPOLOGY_NETWORK),
+               fitness_cache_size(FITNESS_CACHE_SIZE)
+    {
+        parse_layer_shapes(HIDDEN_LAYERS, hidden_layers);
+    }
+
+    /**
+     * @brief Every option that can be set by name
+     *
+     * @return std::vector<ConfigOption>
+     */
+    std::vector<ConfigOption> options()
+    {
+        return {
+            {"boundary_edge_length", ConfigFloat, &boundary_edge_length, "Width and height of the square world"},
+            {"num_obstacles", ConfigInt, &num_obstacles, "Round obstacles placed in every scenario"},
+            {"obstacle_radius", ConfigFloat, &obstacle_radius, "Radius of every obstacle"},
+            {"num_sensed_neighbours", ConfigInt, &num_sensed_neighbours, "Nearest other Agents each Agent senses, more than 0 makes Agents interact"},
+            {"sensing_radius", ConfigFloat, &sensing_radius, "How far away obstacles and other Agents can be sensed"},
+            {"hidden_layers", ConfigLayerShapes, &hidden_layers, "Comma separated hidden layer widths, each can be followed by :<activation>"},
+            {"output_activation", ConfigActivationFunction, &output_activation, "SigmoidActivation, TanhActivation, ReluActivation or LinearActivation"},
+            {"use_biases", ConfigBool, &use_biases, "Give every neuron a bias that is evolved along with its weights"},
+            {"max_mutation_chance", ConfigDouble, &max_mutation_chance, "Upper bound on the per weight mutation chance"},
+            {"mutation_chance_c_value", ConfigDouble, &mutation_chance_c_value, "Mutation chance once the goal is reached"},
+            {"mutation_chance_limit", ConfigFloat, &mutation_chance_limit, "How fast the mutation chance grows with distance"},
+            {"merge_strategy", ConfigMergeType, &merge_strategy, "EveryOther, SingleSplit or RandomChoice"},
+            {"num_gen", ConfigInt, &num_gen, "Number of generations to run"},
+            {"num_ticks_per_gen", ConfigInt, &num_ticks_per_gen, "Number of moves each Agent makes per generation"},
+            {"num_agents_per_gen", ConfigInt, &num_agents_per_gen, "Number of Agents in each generation"},
+            {"num_agents_selected_each_generation", ConfigInt, &num_agents_selected_each_generation, "Number of Agents bred from each generation"},
+            {"num_scenarios", ConfigInt, &num_scenarios, "Start and goal pairs every Agent is evaluated on, only the first is drawn"},
+            {"fitness_reduction", ConfigFitnessReduction, &fitness_reduction, "MeanDistance or WorstDistance over the scenarios"},
+            {"print_generation_performance", ConfigBool, &print_generation_performance, "Print the best distance and mutation chance each generation"},
+            {"draw_generation_performance", ConfigBool, &draw_generation_performance, "Play generations back in a window"},
+            {"draw_seconds_per_frame", ConfigFloat, &draw_seconds_per_frame, "Time each move is shown for"},
+            {"draw_object_size", ConfigFloat, &draw_object_size, "Size of the Agents and the goal"},
+            {"draw_every_nth_generation", ConfigInt, &draw_every_nth_generation, "How often a generation is drawn"},
+            {"draw_full_population", ConfigBool, &draw_full_population, "Draw every Agent rather than just the selected ones"},
+            {"num_islands", ConfigInt, &num_islands, "Populations evolved at once on their own threads, 1 turns island mode off"},
+            {"migration_every_n_generations", ConfigInt, &migration_every_n_generations, "How often islands swap their best agents, 0 never"},
+            {"num_migrants", ConfigInt, &num_migrants, "How many agents each island sends per migration"},
+            {"num_worker_processes", ConfigInt, &num_worker_processes, "Evaluate generations in this many forked processes, 0 evaluates in threads"},
+            {"worker_use_tcp", ConfigBool, &worker_use_tcp, "Talk to worker processes over localhost TCP instead of Unix sockets"},
+            {"pin_worker_processes", ConfigBool, &pin_worker_processes, "Pin each worker process to its own core (Linux only)"},
+            {"worker_timeout_seconds", ConfigInt, &worker_timeout_seconds, "Seconds to wait for a worker's reply before treating it as dead, 0 waits forever"},
+            {"checkpoint_every_n_generations", ConfigInt, &checkpoint_every_n_generations, "How often a checkpoint is written, 0 disables checkpointing"},
+            {"checkpoint_path", ConfigString, &checkpoint_path, "Where checkpoints are written to and resumed from"},
+            {"resume_from_checkpoint", ConfigBool, &resume_from_checkpoint, "Start from the checkpoint at checkpoint_path"},
+            {"seed", ConfigUInt64, &seed, "Seed for every random draw, 0 seeds from the clock"},
+            {"deterministic", ConfigBool, &deterministic, "Swap island migrants in lockstep so a seed always gives the same results"},
+            {"trace_path", ConfigString, &trace_path, "Where every generation's best distance is recorded, empty disables it"},
+            {"verify_trace", ConfigBool, &verify_trace, "Compare the run against the trace at trace_path instead of writing it"},
+            {"telemetry_path", ConfigString, &telemetry_path, "Where per generation telemetry is written when compiled in, empty disables it"},
+            {"use_batched_inference", ConfigBool, &use_batched_inference, "Evaluate the whole population as one batch per tick"},
+            {"weight_precision", ConfigWeightPrecision, &weight_precision, "WeightsFloat32, WeightsFloat16 or WeightsInt8 storage for batched inference"},
+            {"early_exit_settled_agents", ConfigBool, &early_exit_settled_agents, "Stop simulating Agents stuck in a loop"},
+            {"num_threads", ConfigInt, &num_threads, "Simulation threads, 0 uses one per hardware thread"},
+            {"use_fast_sigmoid", ConfigBool, &use_fast_sigmoid, "Use the vectorized sigmoid approximation"},
+            {"use_fixed_topology_network", ConfigBool, &use_fixed_topology_network, "Use the compile time sized network for per agent inference"},
+            {"fitness_cache_size", ConfigInt, &fitness_cache_size, "Entries in each island's cache of already simulated genomes, 0 disables it"},
+        };
+    }
+
+    /**
+     * @brief Set a single option from its text value
+     *
+     * @param name The option's name, see 'options'
+     * @param value The value as text
+     * @return true
+     * @return false The option does not exist or the value could not be parsed, a message has been printed
+     */
+    bool set(const std::string &name, const std::string &value)
+    {
+        if (name == "headless" && is_bool(value.c_str()))
+            return set("draw_generation_performance", parse_bool(value.c_str()) ? "false" : "true");
+
+        for (ConfigOption &option : options())
+        {
+            if (name != option.name)
+                continue;
+
+            const char *text = value.c_str();
+            char *end = NULL;
+            switch (option.type)
+            {
+            case ConfigInt:
+                *(int *)option.value = strtol(text, &end, 10);
+                break;
+            case ConfigUInt64:
+                *(uint64_t *)option.value = strtoull(text, &end, 10);
+                break;
+            case ConfigFloat:
+                *(float *)option.value = strtof(text, &end);
+                break;
+            case ConfigDouble:
+                *(double *)option.value = strtod(text, &end);
+                break;
+            case ConfigBool:
+                if (!is_bool(text))
+                    break;
+                *(bool *)option.value = parse_bool(text);
+                return true;
+            case ConfigString:
+                *(std::string *)option.value = value;
+                return true;
+            case ConfigMergeType:
+                if (value == "EveryOther")
+                    *(MergeType *)option.value = EveryOther;
+                else if (value == "SingleSplit")
+                    *(MergeType *)option.value = SingleSplit;
+                else if (value == "RandomChoice")
+                    *(MergeType *)option.value = RandomChoice;
+                else
+                    break;
+                return true;
+            case ConfigFitnessReduction:
+                if (value == "MeanDistance")
+                    *(FitnessReduction *)option.value = MeanDistance;
+                else if (value == "WorstDistance")
+                    *(FitnessReduction *)option.value = WorstDistance;
+                else
+                    break;
+                return true;
+            case ConfigWeightPrecision:
+                if (value == "WeightsFloat32")
+                    *(WeightPrecision *)option.value = WeightsFloat32;
+                else if (value == "WeightsFloat16")
+                    *(WeightPrecision *)option.value = WeightsFloat16;
+                else if (value == "WeightsInt8")
+                    *(WeightPrecision *)option.value = WeightsInt8;
+                else
+                    break;
+                return true;
+            case ConfigActivationFunction:
+                if (!parse_activation(value, *(ActivationFunction *)option.value))
+                    break;
+                return true;
+            case ConfigLayerShapes:
+                if (!parse_layer_shapes(value, *(std::vector<LayerShape> *)option.value))
+                    break;
+                return true;
+            }
+            if (end && end != text && *end == '\0')
+                return true;
+
+            std::cerr << "Invalid value '" << value << "' for " << name << std::endl;
+            return false;
+        }
+
+        std::cerr << "Unknown option " << name << std::endl;
+        return false;
+    }
+
+    /**
+     * @brief Apply every 'name = value' line of a file
+     *
+     * @param path
+     * @return true
+     * @return false The file could not be read or had a bad line, a message has been printed
+     */
+    bool load_file(const std::string &path)
+    {
+        std::ifstream file(path);
+        if (!file)
+        {
+            std::cerr << "Could not read config file " << path << std::endl;
+            return false;
+        }
+
+        std::string line;
+        for (int line_number = 1; std::getline(file, line); line_number++)
+        {
+            line = trim(line.substr(0, line.find('#')));
+            if (line.empty())
+                continue;
+
+            size_t equals = line.find('=');
+            if (equals == std::string::npos)
+            {
+                std::cerr << path << ":" << line_number << ": expected 'name = value'" << std::endl;
+                return false;
+            }
+            if (!set(trim(line.substr(0, equals)), trim(line.substr(equals + 1))))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Apply the command line, then check the result makes sense
+     *
+     * @param argc
+     * @param argv
+     * @return true
+     * @return false Something was wrong and the run should not go ahead, a message has been printed. Also returned
+     * after printing the usage for --help
+     */
+    bool parse_args(int argc, char **argv)
+    {
+        for (int arg_i = 1; arg_i < argc; arg_i++)
+        {
+            std::string arg = argv[arg_i];
+            if (arg == "--help" || arg == "-h")
+            {
+                print_usage(argv[0]);
+                return false;
+            }
+            if (arg.compare(0, 2, "--") != 0)
+            {
+                std::cerr << "Unexpected argument " << arg << ", see --help" << std::endl;
+                return false;
+            }
+
+            size_t equals = arg.find('=');
+            std::string name = arg.substr(2, equals == std::string::npos ? std::string::npos : equals - 2);
+            // Bare flags switch a bool option on
+            std::string value = equals == std::string::npos ? "true" : arg.substr(equals + 1);
+
+            bool ok = name == "config" ? load_file(value) : set(name, value);
+            if (!ok)
+                return false;
+        }
+        return validate();
+    }
+
+    /**
+     * @brief The number of sensors every Agent has, see 'sense' for how they are laid out
+     *
+     * @return int
+     */
+    int num_sensors() const
+    {
+        return 2 + (num_obstacles > 0 ? 2 : 0) + 2 * num_sensed_neighbours;
+    }
+
+    /**
+     * @brief Check that the settings can be run with
+     *
+     * @return true
+     * @return false A message has been printed
+     */
+    bool validate()
+    {
+        const char *problem = NULL;
+        if (num_gen < 0)
+            problem = "num_gen can not be negative";
+        else if (num_ticks_per_gen < 1)
+            problem = "num_ticks_per_gen must be at least 1";
+        else if (num_agents_selected_each_generation < 3)
+            problem = "num_agents_selected_each_generation must be at least 3, every Agent has two different parents and the last selected is never drawn";
+        else if (num_agents_per_gen < num_agents_selected_each_generation)
+            problem = "num_agents_per_gen must be at least num_agents_selected_each_generation";
+        else if (num_scenarios < 1)
+            problem = "num_scenarios must be at least 1";
+        else if (num_obstacles < 0 || (num_obstacles > 0 && obstacle_radius <= 0))
+            problem = "num_obstacles can not be negative and obstacle_radius must be more than 0";
+        else if (num_sensed_neighbours < 0 || num_sensed_neighbours > SPATIAL_GRID_MAX_NEIGHBOURS)
+            problem = "num_sensed_neighbours must be between 0 and 8";
+        else if ((num_obstacles > 0 || num_sensed_neighbours > 0) && sensing_radius <= 0)
+            problem = "sensing_radius must be more than 0";
+        else if (num_sensed_neighbours > 0 && (!use_batched_inference || num_worker_processes > 0))
+            problem = "num_sensed_neighbours needs use_batched_inference and no worker processes, every Agent has to move in step";
+        else if (draw_every_nth_generation < 1)
+            problem = "draw_every_nth_generation must be at least 1";
+        else if (num_islands < 1)
+            problem = "num_islands must be at least 1";
+        else if (migration_every_n_generations < 0)
+            problem = "migration_every_n_generations can not be negative";
+        else if (num_migrants < 0 || num_migrants >= num_agents_selected_each_generation)
+            problem = "num_migrants must be less than num_agents_selected_each_generation";
+        else if (num_islands > 1 && resume_from_checkpoint)
+            problem = "resume_from_checkpoint can not be used with more than one island";
+        else if (num_worker_processes < 0)
+            problem = "num_worker_processes can not be negative";
+        else if (worker_timeout_seconds < 0)
+            problem = "worker_timeout_seconds can not be negative";
+        else if (num_worker_processes > 0 && num_islands > 1)
+            problem = "num_worker_processes can not be used with more than one island";
+#ifdef _WIN32
+        else if (num_worker_processes > 0)
+            problem = "worker processes are not available on Windows";
+#endif
+        else if (verify_trace && trace_path.empty())
+            problem = "verify_trace needs a trace_path to compare against";
+        else if (checkpoint_every_n_generations < 0)
+            problem = "checkpoint_every_n_generations can not be negative";
+        else if (weight_precision != WeightsFloat32 && !use_batched_inference)
+            problem = "weight_precision other than WeightsFloat32 needs use_batched_inference";
+        else if (fitness_cache_size < 0)
+            problem = "fitness_cache_size can not be negative";
+        else if (num_threads < 0)
+            problem = "num_threads can not be negative";
+        else if (draw_object_size < 0 || boundary_edge_length <= draw_object_size)
+            problem = "boundary_edge_length must be larger than draw_object_size";
+        else if (max_mutation_chance < 0 || max_mutation_chance > 1 || mutation_chance_c_value < 0)
+            problem = "mutation chances must be between 0 and 1";
+
+        if (problem)
+            std::cerr << problem << std::endl;
+        return problem == NULL;
+    }
+
+    void print_usage(const char *program)
+    {
+        std::cout << "Usage: " << program << " [--config=<file>] [--<option>=<value>]..." << std::endl
+                  << std::endl
+                  << "  --config=<file>  Read 'option = value' lines from a file, later flags override it" << std::endl
+                  << "  --headless       Never open a window, the same as --draw_generation_performance=false" << std::endl;
+        for (ConfigOption &option : options())
+            std::cout << "  --" << option.name << "  " << option.description << std::endl;
+    }
+
+private:
+    static bool is_bool(const char *text)
+    {
+        return !strcmp(text, "true") || !strcmp(text, "false") || !strcmp(text, "1") || !strcmp(text, "0") ||
+               !strcmp(text, "yes") || !strcmp(text, "no");
+    }
+
+    static bool parse_bool(const char *text)
+    {
+        return !strcmp(text, "true") || !strcmp(text, "1") || !strcmp(text, "yes");
+    }
+
+    static bool parse_activation(const std::string &text, ActivationFunction &activation)
+    {
+        if (text == "SigmoidActivation")
+            activation = SigmoidActivation;
+        else if (text == "TanhActivation")
+            activation = TanhActivation;
+        else if (text == "ReluActivation")
+            activation = ReluActivation;
+        else if (text == "LinearActivation")
+            activation = LinearActivation;
+        else
+            return false;
+        return true;
+    }
+
+    /**
+     * @brief Parse a list like "16:TanhActivation,8", layers without an activation use the sigmoid. An empty list
+     * connects the inputs straight to the output layer.
+     *
+     * @param text
+     * @param shapes Only overwritten when the whole list parses
+     * @return true
+     * @return false
+     */
+    static bool parse_layer_shapes(const std::string &text, std::vector<LayerShape> &shapes)
+    {
+        std::vector<LayerShape> parsed;
+        size_t begin = 0;
+        while (begin < text.size())
+        {
+            size_t comma = text.find(',', begin);
+            std::string item = trim(text.substr(begin, comma == std::string::npos ? std::string::npos : comma - begin));
+            begin = comma == std::string::npos ? text.size() : comma + 1;
+
+            size_t colon = item.find(':');
+            std::string width = trim(item.substr(0, colon));
+            char *end = NULL;
+            LayerShape shape = {(int)strtol(width.c_str(), &end, 10), SigmoidActivation};
+            if (width.empty() || *end != '\0' || shape.num_neurons < 1)
+                return false;
+            if (colon != std::string::npos && !parse_activation(trim(item.substr(colon + 1)), shape.activation))
+                return false;
+            parsed.push_back(shape);
+        }
+        shapes = parsed;
+        return true;
+    }
+
+    static std::string trim(const std::string &text)
+    {
+        size_t first = text.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos)
+            return "";
+        return text.substr(first, text.find_last_not_of(" \t\r\n") - first + 1);
+    }
+};
+
+// The settings for this run, filled in by main before anything else reads it
+Config config;
+#endif
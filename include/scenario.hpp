@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "spatial_grid.hpp"
+#include "utils.hpp"
+
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+/**
+ * @brief How an Agent's distances from the goal in every scenario are turned into a single fitness, lower is better
+ *
+ * MeanDistance -> The average distance over all scenarios
+ * WorstDistance -> The largest distance in any scenario, favours Agents that never do badly
+ */
+enum FitnessReduction
+{
+    MeanDistance,
+    WorstDistance
+};
+
+// How many places are tried for each obstacle before giving up on it, see 'make_scenarios'
+#define OBSTACLE_PLACEMENT_ATTEMPTS 100
+
+/**
+ * @brief One start and goal pair every Agent is evaluated on, along with the obstacles in its way
+ *
+ * Obstacles are circles of the same radius that Agents can't move into, see 'Agent::apply_move_deltas'.
+ */
+struct Scenario
+{
+    Position start, goal;
+    std::vector<Position> obstacles;
+    float obstacle_radius;
+    // The obstacle centres, so blocking and sensing don't have to check every obstacle
+    SpatialGrid obstacle_grid;
+
+    Scenario(Position start, Position goal) : start(start), goal(goal), obstacle_radius(0) {}
+
+    /**
+     * @brief Place obstacles and index them, replacing any there were
+     *
+     * @param centres
+     * @param radius
+     * @param edge_length Width and height of the world
+     */
+    void set_obstacles(const std::vector<Position> &centres, float radius, float edge_length)
+    {
+        obstacles = centres;
+        obstacle_radius = radius;
+        // Cells about an obstacle across, so a blocking check looks at a handful of cells
+        obstacle_grid.reshape(std::max(1, (int)(edge_length / (2 * radius))), 1);
+        obstacle_grid.build(obstacles.size(), [&](int id, int &layer, float &x, float &y)
+                            { layer = 0;
+                              x = obstacles[id].x;
+                              y = obstacles[id].y; });
+    }
+
+    /**
+     * @brief Check whether a position is inside an obstacle
+     *
+     * @param pos
+     * @return true
+     * @return false
+     */
+    bool blocked(Position pos) const
+    {
+        return !obstacles.empty() && obstacle_grid.any_within(0, pos, obstacle_radius);
+    }
+};
+
+/**
+ * @brief Build the scenarios a generation is evaluated on.
+ *
+ * The first scenario is always the given start and goal, the one that is drawn and checkpointed. The rest are random,
+ * drawn from a generator seeded by the first scenario, so anything that knows the first scenario (a worker process, a
+ * resumed run) builds the same set without it having to be stored or sent.
+ *
+ * Every scenario, the first included, gets its own random obstacles, kept clear of its start and goal. An obstacle that
+ * can't be placed clear of them is left out.
+ *
+ * @param start The start of the first scenario
+ * @param goal The goal of the first scenario
+ * @param num_scenarios The number of scenarios to build, at least 1
+ * @param edge_length Width and height of the world the random scenarios are placed in
+ * @param num_obstacles The number of obstacles to place in each scenario
+ * @param obstacle_radius
+ * @param clearance How far outside an obstacle the start and goal must be, the size of an Agent
+ * @return std::vector<Scenario>
+ */
+std::vector<Scenario> make_scenarios(Position start, Position goal, int num_scenarios, float edge_length, int num_obstacles = 0, float obstacle_radius = 0, float clearance = 0)
+{
+    float coordinates[4] = {start.x, start.y, goal.x, goal.y};
+    uint32_t bits[4];
+    memcpy(bits, coordinates, sizeof(bits));
+    Rng rng(((uint64_t)bits[0] << 32 | bits[1]) ^ ((uint64_t)bits[2] << 32 | bits[3]) * 0x9E3779B97F4A7C15ull);
+
+    std::vector<Scenario> scenarios;
+    scenarios.push_back(Scenario(start, goal));
+    for (int scenario = 1; scenario < num_scenarios; scenario++)
+    {
+        Position scenario_start(rng.uniform(0, edge_length - 1), rng.uniform(0, edge_length - 1));
+        Position scenario_goal(rng.uniform(0, edge_length - 1), rng.uniform(0, edge_length - 1));
+        scenarios.push_back(Scenario(scenario_start, scenario_goal));
+    }
+
+    if (num_obstacles <= 0)
+        return scenarios;
+    float keep_clear = obstacle_radius + clearance;
+    for (int scenario = 0; scenario < num_scenarios; scenario++)
+    {
+        // Split off rather than drawn from rng, so turning obstacles on doesn't move any scenario's start or goal
+        Rng obstacle_rng = rng.split(scenario);
+        Scenario &placing = scenarios[scenario];
+        std::vector<Position> centres;
+        for (int obstacle = 0; obstacle < num_obstacles; obstacle++)
+        {
+            for (int attempt = 0; attempt < OBSTACLE_PLACEMENT_ATTEMPTS; attempt++)
+            {
+                Position centre(obstacle_rng.uniform(0, edge_length - 1), obstacle_rng.uniform(0, edge_length - 1));
+                if (get_distance(centre, placing.start) > keep_clear && get_distance(centre, placing.goal) > keep_clear)
+                {
+                    centres.push_back(centre);
+                    break;
+                }
+            }
+        }
+        placing.set_obstacles(centres, obstacle_radius, edge_length);
+    }
+    return scenarios;
+}
+
+/**
+ * @brief Combine an Agent's distances from the goal in each scenario into its fitness
+ *
+ * @param distances One distance per scenario
+ * @param num_scenarios
+ * @param reduction
+ * @return float The fitness, lower is better
+ */
+float reduce_fitness(const float *distances, int num_scenarios, FitnessReduction reduction)
+{
+    if (reduction == WorstDistance)
+        return *std::max_element(distances, distances + num_scenarios);
+
+    float total = 0;
+    for (int scenario = 0; scenario < num_scenarios; scenario++)
+        total += distances[scenario];
+    return total / num_scenarios;
+}
+#endif
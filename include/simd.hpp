@@ -0,0 +1,530 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_X86 1
+#else
+#define SIMD_X86 0
+#endif
+
+#ifndef SIMD_H
+#define SIMD_H
+
+/**
+ * @brief The instruction sets we have kernels for, picked once at startup based on what the CPU supports.
+ */
+enum SimdLevel
+{
+    SimdScalar,
+    SimdSSE,
+    SimdAVX2,
+    SimdAVX512
+};
+
+/**
+ * @brief The formats a population's weights can be stored in for batched inference, see 'PopulationNetwork'
+ *
+ * WeightsFloat32 -> Full precision, the same weights breeding works on
+ * WeightsFloat16 -> IEEE half precision, converted with F16C where the CPU has it
+ * WeightsInt8 -> Symmetric int8 with one scale per layer of each agent, max(|weight|) maps to 127
+ */
+enum WeightPrecision
+{
+    WeightsFloat32,
+    WeightsFloat16,
+    WeightsInt8
+};
+
+/**
+ * @brief Find the widest instruction set this CPU can run.
+ *
+ * @return SimdLevel The best supported level
+ */
+SimdLevel detect_simd_level()
+{
+#if SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdAVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SimdAVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SimdSSE;
+#endif
+    return SimdScalar;
+}
+
+/**
+ * @brief Whether this CPU can convert half precision floats in hardware
+ *
+ * @return true
+ * @return false
+ */
+bool cpu_has_f16c()
+{
+#if SIMD_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Round a float to the nearest half precision float (ties to even), the same rounding F16C uses.
+ *
+ * @param value
+ * @return uint16_t The half's bits
+ */
+uint16_t float_to_half(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000, mantissa = bits & 0x7FFFFF;
+    int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+
+    if (((bits >> 23) & 0xFF) == 0xFF)
+        return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 31)
+        return sign | 0x7C00;
+    if (exponent <= 0)
+    {
+        // Becomes a subnormal half, or zero
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift, rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | half;
+    }
+
+    // A carry out of the mantissa correctly bumps the exponent, up to infinity
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13), rest = mantissa & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | half;
+}
+
+/**
+ * @brief Widen a half precision float, this is always exact
+ *
+ * @param half The half's bits
+ * @return float
+ */
+float half_to_float(uint16_t half)
+{
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16, exponent = (half >> 10) & 0x1F, mantissa = half & 0x3FF;
+    uint32_t bits;
+    if (exponent == 31)
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    else if (exponent > 0)
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        bits = sign;
+    else
+    {
+        // Subnormal half, normalise it
+        exponent = 127 - 15 + 1;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Polynomial approximation of 2^f for f in [-0.5, 0.5] (Cephes exp2f coefficients, ~1.5e-7 relative error).
+ */
+#define EXP2_P0 1.535336188319500e-4f
+#define EXP2_P1 1.339887440266574e-3f
+#define EXP2_P2 9.618437357674640e-3f
+#define EXP2_P3 5.550332471162809e-2f
+#define EXP2_P4 2.402264791363012e-1f
+#define EXP2_P5 6.931472028550421e-1f
+#define LOG2_E 1.44269504088896341f
+#define EXP2_CLAMP 126.0f
+
+/**
+ * @brief Scalar version of the fast sigmoid, also used for the tail of the vectorized versions.
+ *
+ * sigmoid(x) = 1 / (1 + 2^(-x * log2(e))), with 2^t split into 2^round(t) (built directly in the exponent bits) and a
+ * polynomial for the remaining fraction. Against a double precision sigmoid the absolute error is below 2e-7 for
+ * every float input, the exponent is clamped so very large inputs saturate to 0 / 1 instead of overflowing.
+ *
+ * @param input
+ * @return float
+ */
+float fast_sigmoid(float input)
+{
+    float t = -input * LOG2_E;
+    t = t > EXP2_CLAMP ? EXP2_CLAMP : (t < -EXP2_CLAMP ? -EXP2_CLAMP : t);
+    float n = nearbyintf(t);
+    float f = t - n;
+
+    float p = EXP2_P0;
+    p = p * f + EXP2_P1;
+    p = p * f + EXP2_P2;
+    p = p * f + EXP2_P3;
+    p = p * f + EXP2_P4;
+    p = p * f + EXP2_P5;
+    p = p * f + 1.0f;
+
+    int32_t bits = ((int32_t)n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(float));
+
+    return 1.0f / (1.0f + p * scale);
+}
+
+float dot_product_scalar(const float *a, const float *b, int length)
+{
+    float total = 0;
+    for (int i = 0; i < length; i++)
+        total += a[i] * b[i];
+    return total;
+}
+
+void multiply_accumulate_scalar(float *total, const float *a, const float *b, int length)
+{
+    for (int i = 0; i < length; i++)
+        total[i] += a[i] * b[i];
+}
+
+void fast_sigmoid_array_scalar(float *values, int length)
+{
+    for (int i = 0; i < length; i++)
+        values[i] = fast_sigmoid(values[i]);
+}
+
+void multiply_accumulate_half_scalar(float *total, const uint16_t *a, const float *b, int length)
+{
+    for (int i = 0; i < length; i++)
+        total[i] += half_to_float(a[i]) * b[i];
+}
+
+void multiply_accumulate_int8_scalar(float *total, const int8_t *a, const float *b, int length)
+{
+    for (int i = 0; i < length; i++)
+        total[i] += (float)a[i] * b[i];
+}
+
+#if SIMD_X86
+__attribute__((target("sse2"))) float dot_product_sse(const float *a, const float *b, int length)
+{
+    __m128 total = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= length; i += 4)
+        total = _mm_add_ps(total, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, total);
+    float result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < length; i++)
+        result += a[i] * b[i];
+    return result;
+}
+
+__attribute__((target("sse2"))) void multiply_accumulate_sse(float *total, const float *a, const float *b, int length)
+{
+    int i = 0;
+    for (; i + 4 <= length; i += 4)
+        _mm_storeu_ps(total + i, _mm_add_ps(_mm_loadu_ps(total + i), _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))));
+    for (; i < length; i++)
+        total[i] += a[i] * b[i];
+}
+
+__attribute__((target("sse2"))) void multiply_accumulate_int8_sse(float *total, const int8_t *a, const float *b, int length)
+{
+    int i = 0;
+    for (; i + 4 <= length; i += 4)
+    {
+        int32_t packed;
+        memcpy(&packed, a + i, sizeof(packed));
+        // Sign extend the 4 bytes to 32 bits by moving each to the top of its lane and shifting back down
+        __m128i bytes = _mm_cvtsi32_si128(packed);
+        bytes = _mm_unpacklo_epi8(bytes, bytes);
+        __m128i widened = _mm_srai_epi32(_mm_unpacklo_epi16(bytes, bytes), 24);
+        __m128 weights = _mm_cvtepi32_ps(widened);
+        _mm_storeu_ps(total + i, _mm_add_ps(_mm_loadu_ps(total + i), _mm_mul_ps(weights, _mm_loadu_ps(b + i))));
+    }
+    for (; i < length; i++)
+        total[i] += (float)a[i] * b[i];
+}
+
+__attribute__((target("sse2"))) void fast_sigmoid_array_sse(float *values, int length)
+{
+    int i = 0;
+    for (; i + 4 <= length; i += 4)
+    {
+        __m128 t = _mm_mul_ps(_mm_loadu_ps(values + i), _mm_set1_ps(-LOG2_E));
+        t = _mm_min_ps(_mm_max_ps(t, _mm_set1_ps(-EXP2_CLAMP)), _mm_set1_ps(EXP2_CLAMP));
+        // Default rounding mode is round to nearest
+        __m128i n = _mm_cvtps_epi32(t);
+        __m128 f = _mm_sub_ps(t, _mm_cvtepi32_ps(n));
+
+        __m128 p = _mm_set1_ps(EXP2_P0);
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(EXP2_P1));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(EXP2_P2));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(EXP2_P3));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(EXP2_P4));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(EXP2_P5));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+
+        __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+        __m128 one = _mm_set1_ps(1.0f);
+        _mm_storeu_ps(values + i, _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(p, scale))));
+    }
+    fast_sigmoid_array_scalar(values + i, length - i);
+}
+
+__attribute__((target("avx2,fma"))) float dot_product_avx2(const float *a, const float *b, int length)
+{
+    __m256 total = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+        total = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), total);
+
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(total), _mm256_extractf128_ps(total, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, half);
+    float result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < length; i++)
+        result += a[i] * b[i];
+    return result;
+}
+
+/*
+    The element-wise kernels below must give the same result for a value whether it lands in the vector body or the
+    tail, otherwise an agent's output would depend on where its slice of the population starts. So the AVX2 tails use
+    fmaf / a padded vector pass rather than the plain scalar code.
+*/
+__attribute__((target("avx2,fma"))) void multiply_accumulate_avx2(float *total, const float *a, const float *b, int length)
+{
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+        _mm256_storeu_ps(total + i, _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), _mm256_loadu_ps(total + i)));
+    for (; i < length; i++)
+        total[i] = fmaf(a[i], b[i], total[i]);
+}
+
+__attribute__((target("avx2,fma,f16c"))) void multiply_accumulate_half_avx2(float *total, const uint16_t *a, const float *b, int length)
+{
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        __m256 weights = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(a + i)));
+        _mm256_storeu_ps(total + i, _mm256_fmadd_ps(weights, _mm256_loadu_ps(b + i), _mm256_loadu_ps(total + i)));
+    }
+    // A padded vector pass for the tail, calling out to the software conversion here would leave the upper halves of
+    // the registers dirty for whatever SSE code runs next
+    if (i < length)
+    {
+        uint16_t padded_a[8] = {0};
+        float padded_b[8] = {0}, padded_total[8] = {0};
+        for (int lane = 0; lane < length - i; lane++)
+        {
+            padded_a[lane] = a[i + lane];
+            padded_b[lane] = b[i + lane];
+            padded_total[lane] = total[i + lane];
+        }
+        __m256 weights = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)padded_a));
+        _mm256_storeu_ps(padded_total, _mm256_fmadd_ps(weights, _mm256_loadu_ps(padded_b), _mm256_loadu_ps(padded_total)));
+        for (int lane = 0; lane < length - i; lane++)
+            total[i + lane] = padded_total[lane];
+    }
+}
+
+__attribute__((target("avx2,fma"))) void multiply_accumulate_int8_avx2(float *total, const int8_t *a, const float *b, int length)
+{
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        __m256 weights = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(a + i))));
+        _mm256_storeu_ps(total + i, _mm256_fmadd_ps(weights, _mm256_loadu_ps(b + i), _mm256_loadu_ps(total + i)));
+    }
+    for (; i < length; i++)
+        total[i] = fmaf((float)a[i], b[i], total[i]);
+}
+
+__attribute__((target("avx2,fma"))) void fast_sigmoid_array_avx2(float *values, int length)
+{
+    float padded[8] = {0};
+    for (int i = 0; i < length; i += 8)
+    {
+        float *lanes = values + i;
+        int num_lanes = std::min(8, length - i);
+        if (num_lanes < 8)
+        {
+            memcpy(padded, lanes, num_lanes * sizeof(float));
+            lanes = padded;
+        }
+
+        __m256 t = _mm256_mul_ps(_mm256_loadu_ps(lanes), _mm256_set1_ps(-LOG2_E));
+        t = _mm256_min_ps(_mm256_max_ps(t, _mm256_set1_ps(-EXP2_CLAMP)), _mm256_set1_ps(EXP2_CLAMP));
+        __m256 n = _mm256_round_ps(t, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m256 f = _mm256_sub_ps(t, n);
+
+        __m256 p = _mm256_set1_ps(EXP2_P0);
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_P1));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_P2));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_P3));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_P4));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_P5));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.0f));
+
+        __m256i exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+        __m256 one = _mm256_set1_ps(1.0f);
+        _mm256_storeu_ps(lanes, _mm256_div_ps(one, _mm256_fmadd_ps(p, _mm256_castsi256_ps(exponent), one)));
+
+        if (lanes == padded)
+            memcpy(values + i, padded, num_lanes * sizeof(float));
+    }
+}
+
+__attribute__((target("avx512f"))) float dot_product_avx512(const float *a, const float *b, int length)
+{
+    __m512 total = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= length; i += 16)
+        total = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), total);
+    // Masked load picks up the tail so short rows (our hidden layer is 10 wide) stay in one register
+    if (i < length)
+    {
+        __mmask16 tail = (__mmask16)((1u << (length - i)) - 1);
+        total = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, a + i), _mm512_maskz_loadu_ps(tail, b + i), total);
+    }
+    return _mm512_reduce_add_ps(total);
+}
+
+__attribute__((target("avx512f"))) void multiply_accumulate_avx512(float *total, const float *a, const float *b, int length)
+{
+    int i = 0;
+    for (; i + 16 <= length; i += 16)
+        _mm512_storeu_ps(total + i, _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), _mm512_loadu_ps(total + i)));
+    if (i < length)
+    {
+        __mmask16 tail = (__mmask16)((1u << (length - i)) - 1);
+        __m512 sum = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, a + i), _mm512_maskz_loadu_ps(tail, b + i), _mm512_maskz_loadu_ps(tail, total + i));
+        _mm512_mask_storeu_ps(total + i, tail, sum);
+    }
+}
+
+/*
+    AVX512F alone has no masked 8 or 16 bit loads, so the narrow weights in the tail are copied into a padded buffer
+    (half) or finished with fmaf, which rounds the same as the vector fmadd (int8).
+*/
+__attribute__((target("avx512f"))) void multiply_accumulate_half_avx512(float *total, const uint16_t *a, const float *b, int length)
+{
+    int i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m512 weights = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(a + i)));
+        _mm512_storeu_ps(total + i, _mm512_fmadd_ps(weights, _mm512_loadu_ps(b + i), _mm512_loadu_ps(total + i)));
+    }
+    if (i < length)
+    {
+        uint16_t padded[16] = {0};
+        for (int lane = 0; lane < length - i; lane++)
+            padded[lane] = a[i + lane];
+        __mmask16 tail = (__mmask16)((1u << (length - i)) - 1);
+        __m512 weights = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)padded));
+        __m512 sum = _mm512_fmadd_ps(weights, _mm512_maskz_loadu_ps(tail, b + i), _mm512_maskz_loadu_ps(tail, total + i));
+        _mm512_mask_storeu_ps(total + i, tail, sum);
+    }
+}
+
+__attribute__((target("avx512f"))) void multiply_accumulate_int8_avx512(float *total, const int8_t *a, const float *b, int length)
+{
+    int i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m512 weights = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)(a + i))));
+        _mm512_storeu_ps(total + i, _mm512_fmadd_ps(weights, _mm512_loadu_ps(b + i), _mm512_loadu_ps(total + i)));
+    }
+    for (; i < length; i++)
+        total[i] = fmaf((float)a[i], b[i], total[i]);
+}
+
+__attribute__((target("avx512f"))) void fast_sigmoid_array_avx512(float *values, int length)
+{
+    for (int i = 0; i < length; i += 16)
+    {
+        __mmask16 lanes = length - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (length - i)) - 1);
+        __m512 t = _mm512_mul_ps(_mm512_maskz_loadu_ps(lanes, values + i), _mm512_set1_ps(-LOG2_E));
+        t = _mm512_min_ps(_mm512_max_ps(t, _mm512_set1_ps(-EXP2_CLAMP)), _mm512_set1_ps(EXP2_CLAMP));
+        __m512 n = _mm512_roundscale_ps(t, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m512 f = _mm512_sub_ps(t, n);
+
+        __m512 p = _mm512_set1_ps(EXP2_P0);
+        p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(EXP2_P1));
+        p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(EXP2_P2));
+        p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(EXP2_P3));
+        p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(EXP2_P4));
+        p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(EXP2_P5));
+        p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(1.0f));
+
+        // scalef computes p * 2^n without building the exponent bits by hand
+        __m512 one = _mm512_set1_ps(1.0f);
+        __m512 e = _mm512_scalef_ps(p, n);
+        _mm512_mask_storeu_ps(values + i, lanes, _mm512_div_ps(one, _mm512_add_ps(one, e)));
+    }
+}
+#endif
+
+/**
+ * @brief The kernels selected for this CPU, see 'select_simd_kernels'
+ */
+struct SimdKernels
+{
+    SimdLevel level;
+    float (*dot_product)(const float *a, const float *b, int length);
+    void (*multiply_accumulate)(float *total, const float *a, const float *b, int length);
+    void (*fast_sigmoid_array)(float *values, int length);
+    // The same as multiply_accumulate with narrow weights in 'a', see 'WeightPrecision'
+    void (*multiply_accumulate_half)(float *total, const uint16_t *a, const float *b, int length);
+    void (*multiply_accumulate_int8)(float *total, const int8_t *a, const float *b, int length);
+};
+
+/**
+ * @brief Pick the kernels matching the given instruction set.
+ *
+ * @param level The instruction set to use, anything the build does not have kernels for falls back to scalar
+ * @return SimdKernels
+ */
+SimdKernels select_simd_kernels(SimdLevel level)
+{
+#if SIMD_X86
+    // Half conversions need F16C, without it they are done in software
+    bool f16c = cpu_has_f16c();
+    switch (level)
+    {
+    case SimdAVX512:
+        return {SimdAVX512, dot_product_avx512, multiply_accumulate_avx512, fast_sigmoid_array_avx512,
+                f16c ? multiply_accumulate_half_avx512 : multiply_accumulate_half_scalar, multiply_accumulate_int8_avx512};
+    case SimdAVX2:
+        return {SimdAVX2, dot_product_avx2, multiply_accumulate_avx2, fast_sigmoid_array_avx2,
+                f16c ? multiply_accumulate_half_avx2 : multiply_accumulate_half_scalar, multiply_accumulate_int8_avx2};
+    case SimdSSE:
+        return {SimdSSE, dot_product_sse, multiply_accumulate_sse, fast_sigmoid_array_sse, multiply_accumulate_half_scalar, multiply_accumulate_int8_sse};
+    default:
+        break;
+    }
+#endif
+    return {SimdScalar, dot_product_scalar, multiply_accumulate_scalar, fast_sigmoid_array_scalar, multiply_accumulate_half_scalar, multiply_accumulate_int8_scalar};
+}
+
+/**
+ * @brief Kernels for the CPU we are running on, resolved once at startup.
+ */
+SimdKernels simd = select_simd_kernels(detect_simd_level());
+#endif
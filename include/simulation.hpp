@@ -0,0 +1,463 @@
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "utils.hpp"
+#include "agents.hpp"
+#include "runtime_config.hpp"
+#include "scenario.hpp"
+#include "spatial_grid.hpp"
+#include "batched_inference.hpp"
+#include "thread_pool.hpp"
+#include "telemetry.hpp"
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+// Room for every sensor an Agent can have, see 'Config::num_sensors'
+#define MAX_AGENT_SENSORS (4 + 2 * SPATIAL_GRID_MAX_NEIGHBOURS)
+
+/**
+ * @brief What every Agent senses each tick, with the settings it needs read once.
+ *
+ * The sensors are the offset from the goal over the world's size, then when there are obstacles the offset from the
+ * nearest one in range, then the offset from each sensed neighbour, closest first, see 'Config::num_sensors'. Offsets
+ * are from the thing sensed to the Agent. Obstacle and neighbour offsets are over their range so they stay in [-1, 1],
+ * anything out of range reads as 0.
+ */
+struct Senses
+{
+    float edge_length, sensing_radius;
+    bool obstacles;
+    int num_neighbours;
+
+    Senses() : edge_length(config.boundary_edge_length), sensing_radius(config.sensing_radius), obstacles(config.num_obstacles > 0),
+               num_neighbours(config.num_sensed_neighbours) {}
+
+    /**
+     * @brief Fill in what an Agent senses at a position, sensor i is written to sensors[i * stride]
+     *
+     * @param scenario The scenario the Agent is in
+     * @param pos Where the Agent is
+     * @param sensors
+     * @param stride The distance between two sensors, 1 for a single Agent or the batch size for a batch
+     * @param neighbours Where every Agent is, including this one, only read when Agents sense each other
+     * @param layer The scenario's layer in 'neighbours'
+     */
+    void sense(const Scenario &scenario, Position pos, float *sensors, int stride, const SpatialGrid *neighbours = NULL, int layer = 0) const
+    {
+        sensors[0] = (pos.x - scenario.goal.x) / edge_length;
+        sensors[stride] = (pos.y - scenario.goal.y) / edge_length;
+        if (!obstacles && num_neighbours == 0)
+            return;
+
+        GridNeighbour found[SPATIAL_GRID_MAX_NEIGHBOURS];
+        int sensor = 2;
+        if (obstacles)
+        {
+            // Obstacles are sensed by their edge, so reach past it to their centre
+            float reach = sensing_radius + scenario.obstacle_radius;
+            bool in_range = scenario.obstacle_grid.nearest(0, pos, reach, 1, false, found) > 0;
+            sensors[sensor++ * stride] = in_range ? (pos.x - found[0].pos.x) / reach : 0;
+            sensors[sensor++ * stride] = in_range ? (pos.y - found[0].pos.y) / reach : 0;
+        }
+
+        int num_found = num_neighbours > 0 && neighbours ? neighbours->nearest(layer, pos, sensing_radius, num_neighbours, true, found) : 0;
+        for (int neighbour = 0; neighbour < num_neighbours; neighbour++)
+        {
+            bool in_range = neighbour < num_found;
+            sensors[sensor++ * stride] = in_range ? (pos.x - found[neighbour].pos.x) / sensing_radius : 0;
+            sensors[sensor++ * stride] = in_range ? (pos.y - found[neighbour].pos.y) / sensing_radius : 0;
+        }
+    }
+};
+
+/**
+ * @brief Give agents [begin, end) their slots in a batch and load their weights, see 'run_sim_batched'
+ *
+ * @param agents
+ * @param begin
+ * @param end
+ * @param num_scenarios
+ * @param population
+ */
+void load_slots(std::vector<Agent *> &agents, int begin, int end, int num_scenarios, PopulationNetwork &population)
+{
+    int *slot_agent = population.slot_agent.data(), *slot_scenario = population.slot_scenario.data();
+    for (int slot = begin * num_scenarios; slot < end * num_scenarios; slot++)
+    {
+        slot_agent[slot] = slot / num_scenarios;
+        slot_scenario[slot] = slot % num_scenarios;
+        population.load(slot, agents[slot_agent[slot]]->nn);
+    }
+}
+
+/**
+ * @brief Run a generation for agents [begin, end) with their Neural Networks evaluated as one batch per tick.
+ *
+ * Every Agent takes one slot of the batch per scenario, agent major, so agent i in scenario s sits in slot
+ * i * num_scenarios + s and a range of agents is a contiguous range of slots. Each scenario is just more lanes of the
+ * same SIMD forward pass, and a settled scenario is swapped out of the batch on its own.
+ *
+ * @param agents The agents to simulate
+ * @param begin The first agent to simulate
+ * @param end One past the last agent to simulate
+ * @param scenarios The start and goal pairs to run every Agent through
+ * @param population Already shaped for all of 'agents' in every scenario, the range's weights are loaded here
+ */
+void run_sim_batched(std::vector<Agent *> &agents, int begin, int end, const std::vector<Scenario> &scenarios, PopulationNetwork &population)
+{
+    int num_slots = population.num_agents, num_controls = population.num_outputs;
+    int num_scenarios = scenarios.size();
+    // Read once, so the loops below are as tight as with compile time constants
+    int num_ticks = config.num_ticks_per_gen;
+    bool early_exit = config.early_exit_settled_agents;
+    Senses senses;
+    int *slot_agent = population.slot_agent.data(), *slot_scenario = population.slot_scenario.data();
+    int slots_begin = begin * num_scenarios, slots_end = end * num_scenarios;
+    load_slots(agents, begin, end, num_scenarios, population);
+
+    // Laid out as [sensor][slot] and [control][slot], see PopulationNetwork
+    float *sensors = population.inputs.data(), *controls = population.outputs.data();
+    // Slots still being simulated are kept packed in [slots_begin, active_end)
+    int active_end = slots_end;
+    TELEMETRY_ONLY(uint64_t forward_passes = 0;)
+
+    for (int tick = 0; tick < num_ticks && active_end > slots_begin; tick++)
+    {
+        // Sense every Agents distance from the goal, and any obstacles
+        for (int slot = slots_begin; slot < active_end; slot++)
+        {
+            Position pos = agents[slot_agent[slot]]->scenario_position(slot_scenario[slot]);
+            senses.sense(scenarios[slot_scenario[slot]], pos, sensors + slot, num_slots);
+        }
+
+        // Ask every Agent what it wants to do at once
+        population.forward(slots_begin, active_end, sensors, controls);
+        TELEMETRY_ONLY(forward_passes += active_end - slots_begin;)
+
+        for (int slot = slots_begin; slot < active_end; slot++)
+        {
+            Agent *a = agents[slot_agent[slot]];
+            for (int control = 0; control < num_controls; control++)
+                a->move_deltas[control] = controls[control * num_slots + slot];
+            a->apply_move_deltas(a->move_deltas.data(), slot_scenario[slot], senses.obstacles ? &scenarios[slot_scenario[slot]] : NULL);
+        }
+
+        if (!early_exit)
+            continue;
+
+        // Swap settled Agents out of the batch so they cost nothing from here on
+        for (int slot = slots_begin; slot < active_end;)
+        {
+            if (agents[slot_agent[slot]]->check_settled(num_ticks, slot_scenario[slot]))
+                population.move_agent(--active_end, slot);
+            else
+                slot++;
+        }
+    }
+    TELEMETRY_COUNT(CounterForwardPasses, forward_passes);
+}
+
+/**
+ * @brief Run a generation for agents [begin, end), one Agent at a time.
+ *
+ * @param agents The agents to simulate
+ * @param begin The first agent to simulate
+ * @param end One past the last agent to simulate
+ * @param scenarios The start and goal pairs to run every Agent through
+ */
+void run_sim_per_agent(std::vector<Agent *> &agents, int begin, int end, const std::vector<Scenario> &scenarios)
+{
+    int num_scenarios = scenarios.size();
+    int num_active = (end - begin) * num_scenarios;
+    // Read once, so the loops below are as tight as with compile time constants
+    int num_ticks = config.num_ticks_per_gen;
+    bool early_exit = config.early_exit_settled_agents;
+    Senses senses;
+    float sensors[MAX_AGENT_SENSORS];
+    TELEMETRY_ONLY(uint64_t forward_passes = 0;)
+    for (int tick = 0; tick < num_ticks && num_active > 0; tick++)
+    {
+        for (int agent_i = begin; agent_i < end; agent_i++)
+        {
+            Agent *a = agents[agent_i];
+            for (int scenario = 0; scenario < num_scenarios; scenario++)
+            {
+                if (a->scenario_settled(scenario))
+                    continue;
+                // Sense the Agents distance from the goal, and any obstacles
+                senses.sense(scenarios[scenario], a->scenario_position(scenario), sensors, 1);
+                // Ask the Agent what it wants to do
+                a->move(sensors, scenario, senses.obstacles ? &scenarios[scenario] : NULL);
+                TELEMETRY_ONLY(forward_passes++;)
+
+                if (early_exit && a->check_settled(num_ticks, scenario))
+                    num_active--;
+            }
+        }
+    }
+    TELEMETRY_COUNT(CounterForwardPasses, forward_passes);
+}
+
+/**
+ * @brief Run a generation for agents [begin, end) with whichever inference path is configured.
+ *
+ * The agents are expected to already be reset to the first scenario's start, they are put at the start of every
+ * other scenario here.
+ *
+ * @param agents The agents to simulate
+ * @param begin The first agent to simulate
+ * @param end One past the last agent to simulate
+ * @param scenarios The start and goal pairs to run every Agent through
+ * @param population Already shaped for all of 'agents' when batched inference is used, see 'shape_population'
+ */
+void run_sim_range(std::vector<Agent *> &agents, int begin, int end, const std::vector<Scenario> &scenarios, PopulationNetwork &population)
+{
+    for (int agent_i = begin; agent_i < end; agent_i++)
+        agents[agent_i]->reset_scenarios(scenarios);
+
+    if (config.use_batched_inference)
+        run_sim_batched(agents, begin, end, scenarios, population);
+    else
+        run_sim_per_agent(agents, begin, end, scenarios);
+}
+
+/**
+ * @brief Shape a PopulationNetwork for batched inference over every Agent in every scenario
+ *
+ * @param population
+ * @param agents
+ * @param num_scenarios
+ */
+void shape_population(PopulationNetwork &population, std::vector<Agent *> &agents, int num_scenarios)
+{
+    population.reshape(agents.size() * num_scenarios, agents[0]->nn);
+}
+
+/**
+ * @brief Run a generation where Agents sense each other, so every Agent in every scenario moves in step.
+ *
+ * Each tick starts by rebuilding a SpatialGrid of where every slot is, one layer per scenario, then the pool splits
+ * sensing, the forward pass and moving between its threads by agent. Neighbours are only ever read from the grid, so
+ * no thread sees another's moves before the tick is over and the result doesn't depend on the thread count. An Agent
+ * that can be pushed around by others never settles, so every slot runs every tick and the grid is rebuilt rather than
+ * updated, see 'SpatialGrid'.
+ *
+ * @param agents The agents to simulate, already reset to the first scenario's start
+ * @param scenarios The start and goal pairs to run every Agent through
+ * @param population Already shaped for all of 'agents' in every scenario, see 'shape_population'
+ * @param pool The threads to split each tick between
+ */
+void run_sim_interacting(std::vector<Agent *> &agents, const std::vector<Scenario> &scenarios, PopulationNetwork &population, ThreadPool &pool)
+{
+    int num_slots = population.num_agents, num_controls = population.num_outputs;
+    int num_scenarios = scenarios.size();
+    // Read once, so the loops below are as tight as with compile time constants
+    int num_ticks = config.num_ticks_per_gen;
+    Senses senses;
+    int *slot_agent = population.slot_agent.data(), *slot_scenario = population.slot_scenario.data();
+    // Each island runs its generations on its own thread, keeping the grid here means it is only allocated once. The
+    // pool's threads have their own thread_local copy, so they are handed this one by reference
+    static thread_local SpatialGrid island_grid;
+    SpatialGrid &grid = island_grid;
+    grid.reshape(SpatialGrid::cells_for(agents.size()), num_scenarios);
+
+    auto load_slice = [&](int begin, int end)
+    {
+        for (int agent_i = begin; agent_i < end; agent_i++)
+            agents[agent_i]->reset_scenarios(scenarios);
+        load_slots(agents, begin, end, num_scenarios, population);
+    };
+    pool.parallel_for(agents.size(), load_slice);
+
+    // Laid out as [sensor][slot] and [control][slot], see PopulationNetwork
+    float *sensors = population.inputs.data(), *controls = population.outputs.data();
+    auto tick_slice = [&](int begin, int end)
+    {
+        int slots_begin = begin * num_scenarios, slots_end = end * num_scenarios;
+        for (int slot = slots_begin; slot < slots_end; slot++)
+        {
+            Position pos = agents[slot_agent[slot]]->scenario_position(slot_scenario[slot]);
+            senses.sense(scenarios[slot_scenario[slot]], pos, sensors + slot, num_slots, &grid, slot_scenario[slot]);
+        }
+
+        population.forward(slots_begin, slots_end, sensors, controls);
+
+        for (int slot = slots_begin; slot < slots_end; slot++)
+        {
+            Agent *a = agents[slot_agent[slot]];
+            for (int control = 0; control < num_controls; control++)
+                a->move_deltas[control] = controls[control * num_slots + slot];
+            a->apply_move_deltas(a->move_deltas.data(), slot_scenario[slot], senses.obstacles ? &scenarios[slot_scenario[slot]] : NULL);
+        }
+    };
+
+    for (int tick = 0; tick < num_ticks; tick++)
+    {
+        grid.build(num_slots, [&](int slot, int &layer, float &x, float &y)
+                   { layer = slot_scenario[slot];
+                     Position pos = agents[slot_agent[slot]]->scenario_position(layer);
+                     x = pos.x;
+                     y = pos.y; });
+        pool.parallel_for(agents.size(), tick_slice);
+    }
+    TELEMETRY_COUNT(CounterForwardPasses, (uint64_t)num_ticks * num_slots);
+}
+
+/**
+ * @brief Run a whole generation.
+ *
+ * Unless num_sensed_neighbours is set Agents never interact within a tick, so each thread in the pool takes a
+ * contiguous slice of the population and runs it for every tick on its own, the threads only join once the generation
+ * is over. With early_exit_settled_agents a slice is done as soon as every Agent in it has settled, see
+ * 'Agent::check_settled'. Agents that sense each other are run by 'run_sim_interacting' instead.
+ *
+ * @param agents The agents to simulate
+ * @param scenarios The start and goal pairs to run every Agent through, see 'make_scenarios'
+ * @param population Reused between generations so the batch buffers are only allocated once
+ * @param pool The threads to split the agents between
+ */
+void run_sim(std::vector<Agent *> &agents, const std::vector<Scenario> &scenarios, PopulationNetwork &population, ThreadPool &pool)
+{
+    if (agents.empty())
+        return;
+    if (config.use_batched_inference)
+        shape_population(population, agents, scenarios.size());
+    if (config.num_sensed_neighbours > 0)
+    {
+        run_sim_interacting(agents, scenarios, population, pool);
+        return;
+    }
+
+    auto simulate_slice = [&](int begin, int end)
+    {
+        run_sim_range(agents, begin, end, scenarios, population);
+    };
+    pool.parallel_for(agents.size(), simulate_slice);
+}
+
+/**
+ * @brief How far fitness moved when a generation was run with quantized weights, see 'measure_fitness_drift'
+ */
+struct FitnessDrift
+{
+    float mean, max;
+    // How many of the best agents at full precision are still among the best when quantized
+    int selected_kept;
+};
+
+/**
+ * @brief Run a generation at full precision and again with config.weight_precision, and compare their fitness.
+ *
+ * Every Agent is reset to the first scenario's start and left at the end of the quantized run.
+ *
+ * @param agents The agents to compare
+ * @param scenarios The start and goal pairs to run every Agent through
+ * @param pool The threads to split the agents between
+ * @param num_selected How many of the best agents selection would take
+ * @param reduction How each Agent's distances in the scenarios are combined
+ * @return FitnessDrift
+ */
+FitnessDrift measure_fitness_drift(std::vector<Agent *> &agents, const std::vector<Scenario> &scenarios, ThreadPool &pool, int num_selected, FitnessReduction reduction)
+{
+    int num_agents = agents.size();
+    PopulationNetwork exact(WeightsFloat32), quantized(config.weight_precision);
+    std::vector<std::pair<float, int>> exact_rank, quantized_rank;
+
+    PopulationNetwork *networks[2] = {&exact, &quantized};
+    std::vector<std::pair<float, int>> *ranks[2] = {&exact_rank, &quantized_rank};
+    for (int run = 0; run < 2; run++)
+    {
+        for (Agent *agent : agents)
+            agent->reset(scenarios[0].start, EndpointsOnly);
+        run_sim(agents, scenarios, *networks[run], pool);
+        for (int agent_i = 0; agent_i < num_agents; agent_i++)
+            ranks[run]->push_back(std::make_pair(agents[agent_i]->score(scenarios, reduction), agent_i));
+    }
+
+    FitnessDrift drift = {0, 0, 0};
+    for (int agent_i = 0; agent_i < num_agents; agent_i++)
+    {
+        float difference = std::fabs(quantized_rank[agent_i].first - exact_rank[agent_i].first);
+        drift.mean += difference / num_agents;
+        drift.max = std::max(drift.max, difference);
+    }
+
+    num_selected = std::min(num_selected, num_agents);
+    std::sort(exact_rank.begin(), exact_rank.end());
+    std::sort(quantized_rank.begin(), quantized_rank.end());
+    for (int exact_i = 0; exact_i < num_selected; exact_i++)
+        for (int quantized_i = 0; quantized_i < num_selected; quantized_i++)
+            drift.selected_kept += exact_rank[exact_i].second == quantized_rank[quantized_i].second;
+    return drift;
+}
+
+/**
+ * @brief Get agents [begin, end) of a generation ready to be simulated, see 'setup_agent_generation'
+ *
+ * Each child picks its parents, merges and mutates with its own stream split from streams by its index, so a child
+ * comes out the same whichever thread breeds it and whatever range it is bred in.
+ *
+ * @param agents The Agents to set up, reused from an earlier generation
+ * @param begin The first Agent to set up
+ * @param end One past the last Agent to set up
+ * @param start_pos The start position for every Agent
+ * @param based_on The previous generation's selected Agents, or NULL to keep the Agents' current Neural Networks
+ * @param mt The merge strategy to breed with
+ * @param mutation_chance Mutation chance for any given weight in the NN
+ * @param retention How much of each Agent's path to keep
+ * @param streams Every child's generator is split from this, use a different one each generation
+ */
+void setup_agent_range(std::vector<Agent *> &agents, int begin, int end, Position *start_pos, std::vector<AgentDistancePair> *based_on, MergeType mt, float mutation_chance, TrajectoryRetention retention, const Rng &streams)
+{
+    TELEMETRY_ONLY(uint64_t draws_before = telemetry_thread_counts[CounterRngDraws];)
+    for (int agent_i = begin; agent_i < end; agent_i++)
+    {
+        Agent *agent = agents[agent_i];
+        // Check if we are basing our agents on anything
+        if (based_on)
+        {
+            Rng rng = streams.split(agent_i);
+            int choice1 = get_rand_int(0, based_on->size() - 1, rng), choice2 = get_rand_int(0, based_on->size() - 1, rng);
+            while (choice2 == choice1)
+                choice2 = get_rand_int(0, based_on->size() - 1, rng);
+            agent->breed(*start_pos, based_on->at(choice1).agent, based_on->at(choice2).agent, mt, mutation_chance, retention, rng);
+        }
+        else
+        {
+            agent->reset(*start_pos, retention);
+        }
+    }
+    // Draws on pool threads would never be read, so hand them to the shared count
+    TELEMETRY_ONLY(TELEMETRY_COUNT(CounterRngDraws, telemetry_thread_counts[CounterRngDraws] - draws_before);
+                   telemetry_thread_counts[CounterRngDraws] = draws_before;)
+}
+
+/**
+ * @brief Get a generation ready to be simulated, breeding it in place when it is based on a previous generation.
+ *
+ * Children are bred in parallel, and the generation comes out the same whatever the number of threads, see
+ * 'setup_agent_range'.
+ *
+ * @param agents The Agents to set up, reused from an earlier generation
+ * @param start_pos The start position for every Agent
+ * @param based_on The previous generation's selected Agents, or NULL to keep the Agents' current Neural Networks
+ * @param mt The merge strategy to breed with
+ * @param mutation_chance Mutation chance for any given weight in the NN
+ * @param retention How much of each Agent's path to keep
+ * @param streams Every child's generator is split from this, use a different one each generation
+ * @param pool The threads to split the children between, NULL breeds them all on this thread
+ */
+void setup_agent_generation(std::vector<Agent *> &agents, Position *start_pos, std::vector<AgentDistancePair> *based_on = NULL, MergeType mt = SingleSplit, float mutation_chance = 0.01, TrajectoryRetention retention = EndpointsOnly, const Rng &streams = generator, ThreadPool *pool = NULL)
+{
+    auto breed_slice = [&](int begin, int end)
+    {
+        setup_agent_range(agents, begin, end, start_pos, based_on, mt, mutation_chance, retention, streams);
+    };
+
+    if (pool)
+        pool->parallel_for(agents.size(), breed_slice);
+    else
+        breed_slice(0, agents.size());
+}
+#endif
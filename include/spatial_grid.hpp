@@ -0,0 +1,379 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "utils.hpp"
+
+#ifndef SPATIAL_GRID_H
+#define SPATIAL_GRID_H
+
+// The most neighbours a single 'nearest' query can return, sized so the query can keep its results on the stack
+#define SPATIAL_GRID_MAX_NEIGHBOURS 8
+
+/**
+ * @brief A distinct position held by a SpatialGrid, and how many points sit on it
+ */
+struct GridPoint
+{
+    float x, y;
+    int count;
+};
+
+/**
+ * @brief A point found by 'SpatialGrid::nearest'
+ */
+struct GridNeighbour
+{
+    float distance_squared;
+    Position pos;
+
+    GridNeighbour() : distance_squared(0), pos(0, 0) {}
+};
+
+/**
+ * @brief A uniform grid over a set of points, answering radius and k-nearest queries without looking at every point.
+ *
+ * Points are bucketed into square cells and stored cell by cell, the way a counting sort leaves them: 'cell_start'
+ * holds where each cell's points begin. Rebuilding is a few linear passes over the points, one over the cells and a
+ * sort within each cell, and never allocates once the grid has seen its largest point count, so it is cheap enough to
+ * redo every tick.
+ *
+ * The grid is rebuilt from scratch rather than updated in place. Agents that sense each other all move on every tick,
+ * see 'run_sim_interacting', so an update would still touch every point, and moving points between cells would break
+ * the cell by cell order, the merged duplicates and the fit to the bounding box that keep queries cheap. A build is
+ * O(n) apart from the sorts, and cells only hold a couple of points each, see 'cells_for'.
+ *
+ * The cells are fitted to the points' bounding box on every build rather than to the whole world. Agents start on the
+ * same spot and mostly travel as a crowd, so cells sized for the world would put most of them in a handful of cells
+ * and every query would scan the crowd.
+ *
+ * Points on exactly the same spot are kept once with a count. Agents pile up in the corners and along the walls on the
+ * same clamped positions, and without this every query near a pile would scan the whole pile.
+ *
+ * A grid can hold several independent layers over the same points' space (one per scenario), points only ever find
+ * points on their own layer.
+ */
+struct SpatialGrid
+{
+private:
+    float origin_x, origin_y, cell_size, inverse_cell_size;
+    int cells_per_side, num_layers;
+    // [layer][cell] offsets into 'points', one past the end for the last cell
+    std::vector<int> cell_start;
+    // [layer][cell] whether a cell's points are sorted by y rather than x, see 'nearest_in_cell'
+    std::vector<unsigned char> cell_sorted_by_y;
+    // Each point's layer, cell and unsorted position, only kept between the passes of 'build'
+    std::vector<int> point_layer, point_cell;
+    std::vector<float> scratch_xs, scratch_ys;
+    // The distinct positions, cell by cell, see 'SpatialGrid'
+    std::vector<GridPoint> points;
+
+    int cell_coordinate(float value, float origin) const
+    {
+        int cell = (int)((value - origin) * inverse_cell_size);
+        return std::min(std::max(cell, 0), cells_per_side - 1);
+    }
+
+    /**
+     * @brief Offer every point in one cell to a query
+     *
+     * @return false The query asked to stop
+     */
+    template <typename Function>
+    bool visit_cell(int layer, int cell_x, int cell_y, Function &function) const
+    {
+        int cell = (layer * cells_per_side + cell_y) * cells_per_side + cell_x;
+        for (int point = cell_start[cell]; point < cell_start[cell + 1]; point++)
+            if (!function(points[point]))
+                return false;
+        return true;
+    }
+
+    /**
+     * @brief Offer a cell's points to a nearest query, starting from the closest along the axis the cell is sorted by.
+     *
+     * The walk goes outwards both ways from where 'pos' would sit in the cell's order, and each way stops as soon as
+     * the distance along the axis alone is past 'bound', so a crowded cell only costs the strip of it near 'pos'.
+     *
+     * @param bound The query's current search distance squared, read again after every point
+     * @return false The query asked to stop
+     */
+    template <typename Function>
+    bool nearest_in_cell(int layer, int cell_x, int cell_y, Position pos, const float &bound, Function &function) const
+    {
+        int cell = (layer * cells_per_side + cell_y) * cells_per_side + cell_x;
+        int first = cell_start[cell], last = cell_start[cell + 1];
+        bool by_y = cell_sorted_by_y[cell];
+        float target = by_y ? pos.y : pos.x;
+        auto axis = [by_y](const GridPoint &point)
+        { return by_y ? point.y : point.x; };
+
+        int middle = std::lower_bound(points.begin() + first, points.begin() + last, target, [&](const GridPoint &point, float value)
+                                      { return axis(point) < value; }) -
+                     points.begin();
+        for (int point = middle; point < last; point++)
+        {
+            float gap = axis(points[point]) - target;
+            if (gap * gap > bound)
+                break;
+            if (!function(points[point]))
+                return false;
+        }
+        for (int point = middle - 1; point >= first; point--)
+        {
+            float gap = target - axis(points[point]);
+            if (gap * gap > bound)
+                break;
+            if (!function(points[point]))
+                return false;
+        }
+        return true;
+    }
+
+public:
+    /**
+     * @brief Construct a new Spatial Grid object
+     *
+     * @param cells_per_side The number of cells across the points' bounding box, see 'cells_for'
+     * @param num_layers The number of independent layers
+     */
+    SpatialGrid(int cells_per_side = 1, int num_layers = 1) : origin_x(0), origin_y(0), cell_size(1), inverse_cell_size(1)
+    {
+        reshape(cells_per_side, num_layers);
+    }
+
+    /**
+     * @brief Change the cell or layer count, only allocates when the grid grows. The grid is empty until the next build
+     *
+     * @param cells_per_side The number of cells across the points' bounding box
+     * @param num_layers The number of independent layers
+     */
+    void reshape(int cells_per_side, int num_layers)
+    {
+        this->cells_per_side = std::max(1, cells_per_side);
+        this->num_layers = std::max(1, num_layers);
+        cell_start.assign(this->num_layers * this->cells_per_side * this->cells_per_side + 1, 0);
+        cell_sorted_by_y.assign(this->num_layers * this->cells_per_side * this->cells_per_side, 0);
+    }
+
+    /**
+     * @brief Pick a cell count that leaves a couple of points in each cell, so nearest queries finish within a ring or
+     * two of cells
+     *
+     * @param points_per_layer The number of points on each layer
+     * @return int
+     */
+    static int cells_for(int points_per_layer)
+    {
+        // Past this the cell offsets no longer fit in cache and stop paying for themselves
+        return std::min(std::max((int)std::sqrt(points_per_layer / 2.0f), 1), 1024);
+    }
+
+    /**
+     * @brief Replace every point in the grid
+     *
+     * @param count The number of points
+     * @param point_at Called as point_at(id, layer, x, y) once for every id in [0, count), filling in the point's layer
+     * and position
+     */
+    template <typename Function>
+    void build(int count, Function point_at)
+    {
+        int num_cells = num_layers * cells_per_side * cells_per_side;
+        point_layer.resize(count);
+        point_cell.resize(count);
+        scratch_xs.resize(count);
+        scratch_ys.resize(count);
+        points.resize(count);
+        std::fill(cell_start.begin(), cell_start.end(), 0);
+
+        // Gather the points in id order and fit the cells around them
+        float min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+        for (int id = 0; id < count; id++)
+        {
+            point_at(id, point_layer[id], scratch_xs[id], scratch_ys[id]);
+            min_x = id == 0 ? scratch_xs[id] : std::min(min_x, scratch_xs[id]);
+            max_x = id == 0 ? scratch_xs[id] : std::max(max_x, scratch_xs[id]);
+            min_y = id == 0 ? scratch_ys[id] : std::min(min_y, scratch_ys[id]);
+            max_y = id == 0 ? scratch_ys[id] : std::max(max_y, scratch_ys[id]);
+        }
+        origin_x = min_x;
+        origin_y = min_y;
+        // Every point on the same spot still needs a cell with a size
+        cell_size = std::max(std::max(max_x - min_x, max_y - min_y) / cells_per_side, 1e-3f);
+        inverse_cell_size = 1 / cell_size;
+
+        // Count every cell's points
+        for (int id = 0; id < count; id++)
+        {
+            int cell = (point_layer[id] * cells_per_side + cell_coordinate(scratch_ys[id], origin_y)) * cells_per_side + cell_coordinate(scratch_xs[id], origin_x);
+            point_cell[id] = cell;
+            cell_start[cell + 1]++;
+        }
+        for (int cell = 0; cell < num_cells; cell++)
+            cell_start[cell + 1] += cell_start[cell];
+
+        // Scatter into cell order using cell_start as each cell's cursor, which leaves every cell_start one cell ahead
+        for (int id = 0; id < count; id++)
+        {
+            GridPoint &point = points[cell_start[point_cell[id]]++];
+            point.x = scratch_xs[id];
+            point.y = scratch_ys[id];
+            point.count = 1;
+        }
+
+        // Sort each cell along whichever axis its points are most spread out on, so points on the same spot end up next
+        // to each other and are folded together, packing the cells down as we go. A cell's old end is read before it
+        // is overwritten as the next cell's start
+        int packed = 0, cell_begin = 0;
+        for (int cell = 0; cell < num_cells; cell++)
+        {
+            int cell_end = cell_start[cell];
+            cell_start[cell] = packed;
+            bool by_y = false;
+            if (cell_end - cell_begin > 1)
+            {
+                auto x_order = [](const GridPoint &a, const GridPoint &b)
+                { return a.x < b.x; };
+                auto y_order = [](const GridPoint &a, const GridPoint &b)
+                { return a.y < b.y; };
+                auto x_range = std::minmax_element(points.begin() + cell_begin, points.begin() + cell_end, x_order);
+                auto y_range = std::minmax_element(points.begin() + cell_begin, points.begin() + cell_end, y_order);
+                by_y = y_range.second->y - y_range.first->y > x_range.second->x - x_range.first->x;
+                std::sort(points.begin() + cell_begin, points.begin() + cell_end, [by_y](const GridPoint &a, const GridPoint &b)
+                          { return by_y ? (a.y < b.y || (a.y == b.y && a.x < b.x)) : (a.x < b.x || (a.x == b.x && a.y < b.y)); });
+            }
+            cell_sorted_by_y[cell] = by_y;
+            for (int point = cell_begin; point < cell_end; point++)
+            {
+                if (packed > cell_start[cell] && points[packed - 1].x == points[point].x && points[packed - 1].y == points[point].y)
+                    points[packed - 1].count++;
+                else
+                    points[packed++] = points[point];
+            }
+            cell_begin = cell_end;
+        }
+        cell_start[num_cells] = packed;
+    }
+
+    /**
+     * @brief Offer every point within a radius to a function, in a fixed order
+     *
+     * @param layer The layer to search
+     * @param pos The centre of the search
+     * @param radius
+     * @param function Called as function(point, distance_squared) for every distinct position, return false to stop
+     * the search
+     */
+    template <typename Function>
+    void within(int layer, Position pos, float radius, Function function) const
+    {
+        float radius_squared = radius * radius;
+        auto offer = [&](const GridPoint &point)
+        {
+            float dx = point.x - pos.x, dy = point.y - pos.y;
+            float distance_squared = dx * dx + dy * dy;
+            return distance_squared > radius_squared || function(point, distance_squared);
+        };
+
+        int first_x = cell_coordinate(pos.x - radius, origin_x), last_x = cell_coordinate(pos.x + radius, origin_x);
+        int first_y = cell_coordinate(pos.y - radius, origin_y), last_y = cell_coordinate(pos.y + radius, origin_y);
+        for (int cell_y = first_y; cell_y <= last_y; cell_y++)
+            for (int cell_x = first_x; cell_x <= last_x; cell_x++)
+                if (!visit_cell(layer, cell_x, cell_y, offer))
+                    return;
+    }
+
+    /**
+     * @brief Check whether any point lies within a radius
+     *
+     * @param layer The layer to search
+     * @param pos
+     * @param radius
+     * @return true
+     * @return false
+     */
+    bool any_within(int layer, Position pos, float radius) const
+    {
+        bool found = false;
+        within(layer, pos, radius, [&](const GridPoint &, float)
+               { found = true;
+                 return false; });
+        return found;
+    }
+
+    /**
+     * @brief Find the closest points within a radius, closest first.
+     *
+     * Cells are searched in rings around the cell 'pos' is in, and the search stops as soon as the next ring can't hold
+     * anything closer than the k-th point found, so the cost depends on how crowded it is near 'pos' rather than on how
+     * many points there are. Once k points sit exactly on 'pos' nothing can beat them and the search stops there, which
+     * keeps a crowd of Agents on the same spot from costing a scan of the whole crowd each. Equally distant points keep
+     * the order they were found in, which only depends on the points, so results are deterministic.
+     *
+     * @param layer The layer to search
+     * @param pos The centre of the search
+     * @param radius Points further away than this are never returned
+     * @param k The most points to find, at most SPATIAL_GRID_MAX_NEIGHBOURS
+     * @param skip_self Leave out one point sitting exactly on 'pos', the one searching
+     * @param found Filled with the points found, at least k long
+     * @return int The number of points found
+     */
+    int nearest(int layer, Position pos, float radius, int k, bool skip_self, GridNeighbour *found) const
+    {
+        int num_found = 0;
+        // Nothing further away than this can be found, the radius until there are k points and then the k-th point
+        float bound = radius * radius;
+        auto offer = [&](const GridPoint &point)
+        {
+            float dx = point.x - pos.x, dy = point.y - pos.y;
+            float distance_squared = dx * dx + dy * dy;
+            if (distance_squared > bound)
+                return true;
+
+            int count = point.count - (skip_self && distance_squared == 0);
+            for (int copy = 0; copy < count && (num_found < k || distance_squared < bound); copy++)
+            {
+                // Insertion sort into the k best so far
+                int slot = num_found < k ? num_found++ : k - 1;
+                for (; slot > 0 && distance_squared < found[slot - 1].distance_squared; slot--)
+                    found[slot] = found[slot - 1];
+                found[slot].distance_squared = distance_squared;
+                found[slot].pos = Position(point.x, point.y);
+                if (num_found == k)
+                    bound = found[k - 1].distance_squared;
+            }
+            return num_found < k || bound > 0;
+        };
+
+        if (k <= 0)
+            return 0;
+        int centre_x = cell_coordinate(pos.x, origin_x), centre_y = cell_coordinate(pos.y, origin_y);
+        int max_ring = std::min(cells_per_side, (int)(radius * inverse_cell_size) + 1);
+        for (int ring = 0; ring <= max_ring; ring++)
+        {
+            // Everything in this ring lies outside the square of cells the earlier rings covered
+            float ring_distance = 0;
+            if (ring > 0)
+            {
+                float inner_x = std::min(pos.x - origin_x - (centre_x - ring + 1) * cell_size, origin_x + (centre_x + ring) * cell_size - pos.x);
+                float inner_y = std::min(pos.y - origin_y - (centre_y - ring + 1) * cell_size, origin_y + (centre_y + ring) * cell_size - pos.y);
+                ring_distance = std::max(0.0f, std::min(inner_x, inner_y));
+            }
+            if (ring_distance * ring_distance > bound)
+                break;
+
+            for (int cell_y = centre_y - ring; cell_y <= centre_y + ring; cell_y++)
+            {
+                if (cell_y < 0 || cell_y >= cells_per_side)
+                    continue;
+                // Inner rows of the ring only have their two end cells
+                int step = (cell_y == centre_y - ring || cell_y == centre_y + ring) ? 1 : std::max(1, 2 * ring);
+                for (int cell_x = centre_x - ring; cell_x <= centre_x + ring; cell_x += step)
+                    if (cell_x >= 0 && cell_x < cells_per_side && !nearest_in_cell(layer, cell_x, cell_y, pos, bound, offer))
+                        return num_found;
+            }
+        }
+        return num_found;
+    }
+};
+#endif
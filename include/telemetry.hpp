@@ -0,0 +1,269 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "config.hpp"
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+/**
+ * @brief The parts of a generation that are timed
+ *
+ * Breed -> Setting up the generation's agents, see 'setup_agent_range'. When each thread breeds its own slice and goes
+ *          straight on to simulating it, the pass is split between Breed and Simulate, see 'TelemetrySplitTimer'
+ * Simulate -> Running every agent through the generation, see 'run_sim'
+ * Rank -> Picking the best agents, see 'get_closest_agents'
+ * Draw -> Handing the generation to the Renderer, on the reporting thread, see 'GenerationReporter'
+ * Cleanup -> Everything else at the end of a generation: checkpoints, printing, migration. Includes any wait for the
+ *            previous generation's report
+ */
+enum TelemetryPhase
+{
+    PhaseBreed,
+    PhaseSimulate,
+    PhaseRank,
+    PhaseDraw,
+    PhaseCleanup,
+    NUM_TELEMETRY_PHASES
+};
+
+/**
+ * @brief What is counted, every counter is per generation
+ *
+ * CounterForwardPasses -> Neural Network evaluations, one per agent per simulated tick
+ * CounterRngDraws -> 64 bit values drawn from the generator, on the thread that runs the generation loop
+ * CounterCacheHits -> Agents whose run was copied from the fitness cache instead of simulated, see 'FitnessCache'
+ * CounterCacheMisses -> Agents looked up in the fitness cache and simulated
+ */
+enum TelemetryCounter
+{
+    CounterForwardPasses,
+    CounterRngDraws,
+    CounterCacheHits,
+    CounterCacheMisses,
+    NUM_TELEMETRY_COUNTERS
+};
+
+#if ENABLE_TELEMETRY
+/**
+ * @brief Time spent in each phase, kept per thread so the timers never contend
+ */
+thread_local uint64_t telemetry_phase_ns[NUM_TELEMETRY_PHASES];
+/**
+ * @brief Counters bumped on the counting thread only, cheaper than a shared atomic for very hot counts
+ */
+thread_local uint64_t telemetry_thread_counts[NUM_TELEMETRY_COUNTERS];
+/**
+ * @brief Counters bumped from any thread, meant to be added to in bulk (e.g. once per slice)
+ */
+std::atomic<uint64_t> telemetry_shared_counts[NUM_TELEMETRY_COUNTERS];
+
+/**
+ * @brief Adds the time until it goes out of scope to a phase
+ */
+struct TelemetryPhaseTimer
+{
+    TelemetryPhase phase;
+    std::chrono::steady_clock::time_point start;
+
+    TelemetryPhaseTimer(TelemetryPhase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+
+    ~TelemetryPhaseTimer()
+    {
+        telemetry_phase_ns[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+/**
+ * @brief Times a parallel pass where every slice does the work of two phases, e.g. breeding its agents then simulating them.
+ *
+ * Slices add up how long they spend in each phase with 'TELEMETRY_SLICE'. When the pass ends its wall time is split
+ * between the phases in the same proportion, so the phases still add up to how long the generation took.
+ */
+struct TelemetrySplitTimer
+{
+    TelemetryPhase first, second;
+    std::chrono::steady_clock::time_point start;
+    // Time the slices spent in each phase, summed over every thread
+    std::atomic<uint64_t> first_ns, second_ns;
+
+    TelemetrySplitTimer(TelemetryPhase first, TelemetryPhase second) : first(first), second(second), start(std::chrono::steady_clock::now()), first_ns(0), second_ns(0) {}
+
+    ~TelemetrySplitTimer()
+    {
+        uint64_t wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        uint64_t busy_ns = first_ns + second_ns;
+        uint64_t first_share = busy_ns ? (uint64_t)((double)wall_ns * first_ns / busy_ns) : 0;
+        telemetry_phase_ns[first] += first_share;
+        telemetry_phase_ns[second] += wall_ns - first_share;
+    }
+};
+
+/**
+ * @brief Adds the time until it goes out of scope to one phase of a 'TelemetrySplitTimer', from any thread
+ */
+struct TelemetrySliceTimer
+{
+    std::atomic<uint64_t> &total_ns;
+    std::chrono::steady_clock::time_point start;
+
+    TelemetrySliceTimer(std::atomic<uint64_t> &total_ns) : total_ns(total_ns), start(std::chrono::steady_clock::now()) {}
+
+    ~TelemetrySliceTimer()
+    {
+        total_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+    }
+};
+
+#define TELEMETRY_CONCAT_INNER(a, b) a##b
+#define TELEMETRY_CONCAT(a, b) TELEMETRY_CONCAT_INNER(a, b)
+// Time the rest of the enclosing scope as the given phase
+#define TELEMETRY_PHASE(phase) TelemetryPhaseTimer TELEMETRY_CONCAT(telemetry_timer_, __LINE__)(phase)
+// Time the rest of the enclosing scope as two phases, split by what the slices timed with 'TELEMETRY_SLICE' spent in each
+#define TELEMETRY_SPLIT_PHASES(name, first, second) TelemetrySplitTimer name(first, second)
+// Time the rest of the enclosing scope as the first or second phase of a split, e.g. TELEMETRY_SLICE(split, first)
+#define TELEMETRY_SLICE(name, which) TelemetrySliceTimer TELEMETRY_CONCAT(telemetry_slice_, __LINE__)(name.which##_ns)
+// Add to a counter from any thread
+#define TELEMETRY_COUNT(counter, amount) telemetry_shared_counts[counter].fetch_add(amount, std::memory_order_relaxed)
+// Add one to a counter on this thread only
+#define TELEMETRY_COUNT_THREAD(counter) telemetry_thread_counts[counter]++
+// Code that only exists when telemetry is compiled in
+#define TELEMETRY_ONLY(code) code
+#else
+#define TELEMETRY_PHASE(phase)
+#define TELEMETRY_SPLIT_PHASES(name, first, second)
+#define TELEMETRY_SLICE(name, which)
+#define TELEMETRY_COUNT(counter, amount)
+#define TELEMETRY_COUNT_THREAD(counter)
+#define TELEMETRY_ONLY(code)
+#endif
+
+#if ENABLE_TELEMETRY
+/**
+ * @brief One generation's readings, taken when it ends and written out later
+ */
+struct TelemetrySample
+{
+    int generation;
+    uint64_t phase_ns[NUM_TELEMETRY_PHASES];
+    uint64_t heap_allocations;
+    uint64_t counts[NUM_TELEMETRY_COUNTERS];
+};
+
+/**
+ * @brief Streams one row of phase timings and counters per generation to a file.
+ *
+ * Files ending in .json or .jsonl get one JSON object per line, anything else gets CSV. Readings are taken with
+ * 'take_sample' on the thread running the generation loop, and can be written with 'write' from another thread, which
+ * adds the phases timed on that thread. Rows are buffered rather than flushed one by one, the file is complete once the
+ * writer is destroyed.
+ */
+struct TelemetryWriter
+{
+private:
+    std::ofstream file;
+    bool json;
+    uint64_t (*allocations)();
+    uint64_t allocations_before;
+
+    static bool ends_with(const std::string &text, const std::string &suffix)
+    {
+        return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+public:
+    /**
+     * @brief Construct a new Telemetry Writer object
+     *
+     * @param path Where to write, nothing is recorded when empty
+     * @param allocations Reads the running heap allocation count, see 'allocation_count'
+     */
+    TelemetryWriter(const std::string &path, uint64_t (*allocations)()) : json(ends_with(path, ".json") || ends_with(path, ".jsonl")), allocations(allocations)
+    {
+        if (path.empty())
+            return;
+        file.open(path);
+        if (!file)
+            std::cerr << "Could not write telemetry to " << path << std::endl;
+        else if (!json)
+            file << "generation,breed_ns,simulate_ns,rank_ns,draw_ns,cleanup_ns,heap_allocations,forward_passes,rng_draws,cache_hits,cache_misses" << std::endl;
+        start_generation();
+    }
+
+    /**
+     * @brief Start counting from zero, call before the first generation that will be recorded
+     */
+    void start_generation()
+    {
+        for (int phase = 0; phase < NUM_TELEMETRY_PHASES; phase++)
+            telemetry_phase_ns[phase] = 0;
+        for (int counter = 0; counter < NUM_TELEMETRY_COUNTERS; counter++)
+        {
+            telemetry_thread_counts[counter] = 0;
+            telemetry_shared_counts[counter].store(0, std::memory_order_relaxed);
+        }
+        allocations_before = allocations();
+    }
+
+    /**
+     * @brief Read everything since the last sample and start counting the next generation
+     *
+     * @param generation_number
+     * @return TelemetrySample
+     */
+    TelemetrySample take_sample(int generation_number)
+    {
+        TelemetrySample sample;
+        sample.generation = generation_number;
+        for (int phase = 0; phase < NUM_TELEMETRY_PHASES; phase++)
+            sample.phase_ns[phase] = telemetry_phase_ns[phase];
+        sample.heap_allocations = allocations() - allocations_before;
+        for (int counter = 0; counter < NUM_TELEMETRY_COUNTERS; counter++)
+            sample.counts[counter] = telemetry_shared_counts[counter].load(std::memory_order_relaxed) + telemetry_thread_counts[counter];
+        start_generation();
+        return sample;
+    }
+
+    /**
+     * @brief Write out a sample, along with the time this thread has spent in each phase since its last write
+     *
+     * @param sample
+     */
+    void write(TelemetrySample sample)
+    {
+        for (int phase = 0; phase < NUM_TELEMETRY_PHASES; phase++)
+        {
+            sample.phase_ns[phase] += telemetry_phase_ns[phase];
+            telemetry_phase_ns[phase] = 0;
+        }
+        if (!file.is_open())
+            return;
+
+        uint64_t *ns = sample.phase_ns;
+        uint64_t *counts = sample.counts;
+        if (json)
+            file << "{\"generation\": " << sample.generation << ", \"breed_ns\": " << ns[PhaseBreed] << ", \"simulate_ns\": " << ns[PhaseSimulate]
+                 << ", \"rank_ns\": " << ns[PhaseRank] << ", \"draw_ns\": " << ns[PhaseDraw] << ", \"cleanup_ns\": " << ns[PhaseCleanup]
+                 << ", \"heap_allocations\": " << sample.heap_allocations << ", \"forward_passes\": " << counts[CounterForwardPasses] << ", \"rng_draws\": " << counts[CounterRngDraws]
+                 << ", \"cache_hits\": " << counts[CounterCacheHits] << ", \"cache_misses\": " << counts[CounterCacheMisses] << "}\n";
+        else
+            file << sample.generation << "," << ns[PhaseBreed] << "," << ns[PhaseSimulate] << "," << ns[PhaseRank] << "," << ns[PhaseDraw] << ","
+                 << ns[PhaseCleanup] << "," << sample.heap_allocations << "," << counts[CounterForwardPasses] << "," << counts[CounterRngDraws] << ","
+                 << counts[CounterCacheHits] << "," << counts[CounterCacheMisses] << "\n";
+    }
+
+    /**
+     * @brief Write out everything since the last call and start counting the next generation, all on this thread
+     *
+     * @param generation_number
+     */
+    void record(int generation_number)
+    {
+        write(take_sample(generation_number));
+    }
+};
+#endif
+#endif
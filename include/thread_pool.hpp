@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/**
+ * @brief A fixed set of worker threads that live for the whole run and split index ranges between them.
+ *
+ * Workers are created once and then sleep between jobs, so handing out a generation's work costs a wake-up rather
+ * than thread creation. The calling thread always takes part, so a pool of N threads starts N - 1 workers.
+ */
+struct ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_ready, work_done;
+    int num_threads;
+
+    // The current job, see 'parallel_for'
+    void (*task)(void *context, int begin, int end);
+    void *task_context;
+    int task_count;
+    unsigned long job_id;
+    int workers_busy;
+    bool stopping;
+
+    /**
+     * @brief Run this thread's share of the current job.
+     *
+     * Chunks are contiguous and only depend on the job size and thread count, so a given index is always handled the
+     * same way no matter which thread gets there first.
+     *
+     * @param chunk Which of the num_threads chunks to run
+     */
+    void run_chunk(int chunk)
+    {
+        int begin = (long)task_count * chunk / num_threads;
+        int end = (long)task_count * (chunk + 1) / num_threads;
+        if (begin < end)
+            task(task_context, begin, end);
+    }
+
+    void worker_loop(int chunk)
+    {
+        unsigned long seen_job = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            work_ready.wait(lock, [&]
+                            { return stopping || job_id != seen_job; });
+            if (stopping)
+                return;
+            seen_job = job_id;
+
+            lock.unlock();
+            run_chunk(chunk);
+            lock.lock();
+
+            if (--workers_busy == 0)
+                work_done.notify_one();
+        }
+    }
+
+public:
+    /**
+     * @brief Construct a new Thread Pool object
+     *
+     * @param num_threads Total number of threads to use including the caller, 0 means one per hardware thread
+     */
+    ThreadPool(int num_threads = 0) : task(NULL), task_context(NULL), task_count(0), job_id(0), workers_busy(0), stopping(false)
+    {
+        if (num_threads <= 0)
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        this->num_threads = num_threads;
+
+        for (int chunk = 1; chunk < num_threads; chunk++)
+            workers.push_back(std::thread(&ThreadPool::worker_loop, this, chunk));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    /**
+     * @brief The number of threads work is split between, including the caller
+     *
+     * @return int
+     */
+    int size()
+    {
+        return num_threads;
+    }
+
+    /**
+     * @brief Split [0, count) into one contiguous range per thread and block until every range has been run.
+     *
+     * @param count The number of indices to split up
+     * @param function Called as function(begin, end) once per non-empty range, from several threads at once
+     */
+    template <typename Function>
+    void parallel_for(int count, Function &function)
+    {
+        if (num_threads == 1 || count <= 1)
+        {
+            if (count > 0)
+                function(0, count);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = [](void *context, int begin, int end)
+            { (*(Function *)context)(begin, end); };
+            task_context = &function;
+            task_count = count;
+            workers_busy = workers.size();
+            job_id++;
+        }
+        work_ready.notify_all();
+
+        run_chunk(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        work_done.wait(lock, [&]
+                       { return workers_busy == 0; });
+    }
+};
+#endif
@@ -0,0 +1,162 @@
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * @brief Every generation's best distance on every island, written to a file or checked against one.
+ *
+ * The file starts with a 'seed <n>' line, then has one 'generation,island,distance' line per generation and island.
+ * Distances are hex floats so they survive the round trip exactly. With the same seed and options two runs should
+ * give the same trace, however many threads or worker processes they use, see 'Config::deterministic'. Checking a
+ * run against a trace recorded before a change shows whether the change altered the results.
+ */
+struct ReplayTrace
+{
+private:
+    int num_islands, num_generations;
+    // [generation][island]
+    std::vector<float> distances;
+    std::vector<uint8_t> recorded;
+
+    static bool same_bits(float a, float b)
+    {
+        return memcmp(&a, &b, sizeof(float)) == 0;
+    }
+
+public:
+    /**
+     * @brief Construct a new Replay Trace object
+     *
+     * @param num_islands
+     * @param num_generations The number of generations in the run, including any skipped by resuming
+     */
+    ReplayTrace(int num_islands, int num_generations) : num_islands(num_islands), num_generations(num_generations)
+    {
+        distances.resize((size_t)num_islands * num_generations);
+        recorded.assign((size_t)num_islands * num_generations, 0);
+    }
+
+    /**
+     * @brief Note a generation's best distance, islands can record at the same time as long as each records its own
+     *
+     * @param island
+     * @param generation
+     * @param best_distance
+     */
+    void record(int island, int generation, float best_distance)
+    {
+        size_t entry = (size_t)generation * num_islands + island;
+        distances[entry] = best_distance;
+        recorded[entry] = 1;
+    }
+
+    /**
+     * @brief Write out every recorded generation, call once the run is over
+     *
+     * @param path
+     * @param seed The seed the run was started with
+     * @return true
+     * @return false The file could not be written
+     */
+    bool save(const char *path, uint64_t seed) const
+    {
+        FILE *file = fopen(path, "w");
+        if (!file)
+            return false;
+        fprintf(file, "seed %" PRIu64 "\n", seed);
+        for (size_t entry = 0; entry < distances.size(); entry++)
+            if (recorded[entry])
+                fprintf(file, "%d,%d,%a\n", (int)(entry / num_islands), (int)(entry % num_islands), (double)distances[entry]);
+        bool ok = !ferror(file);
+        return fclose(file) == 0 && ok;
+    }
+
+    /**
+     * @brief Read the seed a trace was recorded with
+     *
+     * @param path
+     * @param seed Set when the trace could be read
+     * @return true
+     * @return false The file is missing or doesn't start with a seed
+     */
+    static bool read_seed(const char *path, uint64_t &seed)
+    {
+        FILE *file = fopen(path, "r");
+        if (!file)
+            return false;
+        bool ok = fscanf(file, "seed %" SCNu64, &seed) == 1;
+        fclose(file);
+        return ok;
+    }
+
+    /**
+     * @brief Compare the run against a recorded trace, the first difference is printed
+     *
+     * Every recorded generation has to be in the trace with a bit-identical distance, and the trace can't hold
+     * generations the run never recorded.
+     *
+     * @param path
+     * @return true
+     * @return false The run differs from the trace, or the trace could not be read
+     */
+    bool verify(const char *path) const
+    {
+        FILE *file = fopen(path, "r");
+        uint64_t seed;
+        if (!file || fscanf(file, "seed %" SCNu64 "\n", &seed) != 1)
+        {
+            if (file)
+                fclose(file);
+            std::cerr << "Could not read the trace at " << path << std::endl;
+            return false;
+        }
+
+        int generation, island, matched = 0;
+        double expected;
+        bool ok = true;
+        while (ok && fscanf(file, "%d,%d,%la\n", &generation, &island, &expected) == 3)
+        {
+            size_t entry = (size_t)generation * num_islands + island;
+            if (generation < 0 || generation >= num_generations || island < 0 || island >= num_islands || !recorded[entry])
+            {
+                std::cout << "Trace mismatch: generation " << generation << " island " << island << " is in the trace but was not run" << std::endl;
+                ok = false;
+            }
+            else if (!same_bits(distances[entry], (float)expected))
+            {
+                std::cout << std::setprecision(9) << "Trace mismatch: generation " << generation << " island " << island << " expected " << (float)expected
+                          << " got " << distances[entry] << std::endl;
+                ok = false;
+            }
+            matched++;
+        }
+        bool at_end = feof(file);
+        fclose(file);
+        if (!ok)
+            return false;
+
+        int num_recorded = 0;
+        for (uint8_t was_recorded : recorded)
+            num_recorded += was_recorded;
+        if (!at_end)
+        {
+            std::cout << "Could not read the trace past its first " << matched << " generations" << std::endl;
+            return false;
+        }
+        if (matched != num_recorded)
+        {
+            std::cout << "Trace mismatch: the trace has " << matched << " generations, the run has " << num_recorded << std::endl;
+            return false;
+        }
+        std::cout << "Trace matches for all " << matched << " generations" << std::endl;
+        return true;
+    }
+};
+#endif
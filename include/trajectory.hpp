@@ -0,0 +1,175 @@
+#include <vector>
+#include "utils.hpp"
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+/**
+ * @brief How much of an Agent's path is kept around
+ *
+ * FullHistory -> Every position is stored, needed when the generation is going to be drawn
+ * EndpointsOnly -> Only the start and the current (at the end of a run, final) position are stored
+ */
+enum TrajectoryRetention
+{
+    FullHistory,
+    EndpointsOnly
+};
+
+/**
+ * @brief Contiguous structure-of-arrays storage for the positions an Agent has visited.
+ *
+ * Storage is sized once when the trajectory is reset, so recording a step never allocates.
+ */
+struct Trajectory
+{
+    std::vector<float> xs, ys;
+    TrajectoryRetention retention;
+    int num_steps;
+
+    /**
+     * @brief Construct a new Trajectory object
+     *
+     * @param start The first position of the trajectory
+     * @param retention How much of the trajectory to keep
+     * @param max_steps The most positions that will ever be pushed, used to size FullHistory storage up front
+     */
+    Trajectory(Position start, TrajectoryRetention retention, int max_steps)
+    {
+        reset(start, retention, max_steps);
+    }
+
+    /**
+     * @brief Start a new trajectory, reusing the existing storage where possible.
+     *
+     * @param start The first position of the trajectory
+     * @param retention How much of the trajectory to keep
+     * @param max_steps The most positions that will ever be pushed, used to size FullHistory storage up front
+     */
+    void reset(Position start, TrajectoryRetention retention, int max_steps)
+    {
+        this->retention = retention;
+        int capacity = retention == FullHistory ? max_steps + 1 : 2;
+        xs.reserve(capacity);
+        ys.reserve(capacity);
+        xs.assign(1, start.x);
+        ys.assign(1, start.y);
+        num_steps = 0;
+    }
+
+    /**
+     * @brief Record the next position
+     *
+     * @param x
+     * @param y
+     */
+    void push(float x, float y)
+    {
+        num_steps++;
+        if (retention == EndpointsOnly && xs.size() == 2)
+        {
+            xs[1] = x;
+            ys[1] = y;
+            return;
+        }
+        xs.push_back(x);
+        ys.push_back(y);
+    }
+
+    /**
+     * @brief Get the current (or, once a run is over, final) position
+     *
+     * @return Position
+     */
+    Position back() const
+    {
+        return Position(xs.back(), ys.back());
+    }
+
+    /**
+     * @brief Get the position after a given number of steps, only valid with FullHistory retention
+     *
+     * @param step
+     * @return Position
+     */
+    Position at(int step) const
+    {
+        return Position(xs[step], ys[step]);
+    }
+
+    /**
+     * @brief The number of positions visited, including the start, whether or not they were all kept
+     *
+     * @return int
+     */
+    int size() const
+    {
+        return num_steps + 1;
+    }
+
+    /**
+     * @brief Fill in the rest of a trajectory that is known to repeat with the given period.
+     *
+     * With FullHistory every missing position is copied from one period earlier. Otherwise the caller has to make
+     * sure the number of steps left is a multiple of the period, so the current position already is the final one.
+     *
+     * @param cycle_length The period the trajectory repeats with
+     * @param total_steps The number of steps the trajectory should end up with
+     */
+    void extend_cycle(int cycle_length, int total_steps)
+    {
+        if (retention == EndpointsOnly)
+        {
+            num_steps = total_steps;
+            return;
+        }
+        while (num_steps < total_steps)
+        {
+            int repeat_of = xs.size() - cycle_length;
+            push(xs[repeat_of], ys[repeat_of]);
+        }
+    }
+};
+
+/**
+ * @brief Spots when a trajectory starts repeating itself, using Brent's algorithm.
+ *
+ * Only one earlier position is remembered (the anchor), which is moved forward every power of two steps, so any cycle
+ * is found within a few of its periods after it starts, using constant memory.
+ */
+struct CycleDetector
+{
+    Position anchor;
+    int power, steps_since_anchor;
+
+    CycleDetector() : anchor(0, 0), power(1), steps_since_anchor(0) {}
+
+    void reset(Position start)
+    {
+        anchor = start;
+        power = 1;
+        steps_since_anchor = 0;
+    }
+
+    /**
+     * @brief Feed the next position of the trajectory
+     *
+     * @param pos
+     * @return int The length of the cycle if this position closed one, otherwise 0
+     */
+    int observe(Position pos)
+    {
+        steps_since_anchor++;
+        if (pos.x == anchor.x && pos.y == anchor.y)
+            return steps_since_anchor;
+
+        if (steps_since_anchor == power)
+        {
+            anchor = pos;
+            power *= 2;
+            steps_since_anchor = 0;
+        }
+        return 0;
+    }
+};
+#endif
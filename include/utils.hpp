@@ -1,15 +1,12 @@
 #include <cmath>
 #include <vector>
 #include <memory>
+#include "simd.hpp"
+#include "rng.hpp"
 
 #ifndef UTILS_H
 #define UTILS_H
 
-/**
- * @brief Used for randomness
- */
-std::default_random_engine generator;
-
 /**
  * @brief Used to encapsulate a position in the world
  */
@@ -37,12 +34,12 @@ float get_distance(Position pos1, Position pos2)
  *
  * @param from From float
  * @param to To float
+ * @param rng The generator to draw from, defaults to this thread's generator
  * @return float Random float between from and to float
  */
-float get_rand_uniform_float(float from, float to)
+float get_rand_uniform_float(float from, float to, Rng &rng = generator)
 {
-    std::uniform_real_distribution<float> distribution(from, to);
-    return distribution(generator);
+    return rng.uniform(from, to);
 }
 
 /**
@@ -50,12 +47,14 @@ float get_rand_uniform_float(float from, float to)
  *
  * @param mean Mean of the random float distribution
  * @param std_dev Standard deviation for the float distribution
+ * @param rng The generator to draw from, defaults to this thread's generator
  * @return float Random float given the inputs
  */
-float get_rand_normal_float(float mean, float std_dev)
+float get_rand_normal_float(float mean, float std_dev, Rng &rng = generator)
 {
-    std::normal_distribution<float> distribution(mean, std_dev);
-    return distribution(generator);
+    // Box-Muller, 1 - uniform() keeps the log argument in (0, 1]
+    float radius = sqrt(-2.0f * log(1.0f - rng.uniform()));
+    return mean + std_dev * radius * cos(6.28318530718f * rng.uniform());
 }
 
 /**
@@ -63,44 +62,40 @@ float get_rand_normal_float(float mean, float std_dev)
  *
  * @param from From Integer
  * @param to To Integer
+ * @param rng The generator to draw from, defaults to this thread's generator
  * @return int Random Integer between from and to
  */
-int get_rand_int(int from, int to)
+int get_rand_int(int from, int to, Rng &rng = generator)
 {
-    std::uniform_real_distribution<float> distribution(from, to);
-    return (int)distribution(generator);
+    return (int)rng.uniform(from, to);
 }
 
 /**
  * @brief Get a random boolean
  *
  * @param chance The float chance for true (must be between 0-1)
+ * @param rng The generator to draw from, defaults to this thread's generator
  * @return true
  * @return false
  */
-bool get_rand_bool(float chance = 0.5)
+bool get_rand_bool(float chance = 0.5, Rng &rng = generator)
 {
-    return get_rand_uniform_float(0.0, 1.0) < chance;
+    return rng.uniform() < chance;
 }
 
 /**
  * @brief Find the dot product bewteen two float arrays
  *
+ * Runs on the widest SIMD kernel this CPU supports, see 'simd.hpp'.
+ *
  * @param a Float array 1
  * @param b Float array 2
  * @param length The length of each array (should be the same between both)
  * @return float The dot product resultant
  */
-float dot_product(float *a, float *b, int length)
+float dot_product(const float *a, const float *b, int length)
 {
-    float total = 0;
-
-    for (int i = 0; i < length; i++)
-    {
-        total += a[i] * b[i];
-    }
-
-    return total;
+    return simd.dot_product(a, b, length);
 }
 
 /**
@@ -114,6 +109,73 @@ float sigmoid(float input)
     return 1 / (1 + exp(-input));
 }
 
+/**
+ * @brief Apply the sigmoid to every value in a float array, in place
+ *
+ * @param values The values to run through the sigmoid
+ * @param length The length of the array
+ * @param fast Use the vectorized approximation instead of 'exp', see 'fast_sigmoid' for its error bound
+ */
+void sigmoid_array(float *values, int length, bool fast = false)
+{
+    if (fast)
+    {
+        simd.fast_sigmoid_array(values, length);
+        return;
+    }
+
+    for (int i = 0; i < length; i++)
+        values[i] = sigmoid(values[i]);
+}
+
+/**
+ * @brief The functions a layer of a Neural Network can run its outputs through
+ */
+enum ActivationFunction
+{
+    SigmoidActivation,
+    TanhActivation,
+    ReluActivation,
+    LinearActivation
+};
+
+/**
+ * @brief The shape of a single layer in a Neural Network, the number of inputs comes from the layer before it
+ */
+struct LayerShape
+{
+    int num_neurons;
+    ActivationFunction activation;
+};
+
+/**
+ * @brief Apply an activation function to every value in a float array, in place
+ *
+ * @param values The values to activate
+ * @param length The length of the array
+ * @param activation The function to apply
+ * @param fast Use the vectorized sigmoid approximation, only changes SigmoidActivation
+ */
+void activate_array(float *values, int length, ActivationFunction activation, bool fast = false)
+{
+    switch (activation)
+    {
+    case SigmoidActivation:
+        sigmoid_array(values, length, fast);
+        break;
+    case TanhActivation:
+        for (int i = 0; i < length; i++)
+            values[i] = tanh(values[i]);
+        break;
+    case ReluActivation:
+        for (int i = 0; i < length; i++)
+            values[i] = values[i] > 0 ? values[i] : 0;
+        break;
+    case LinearActivation:
+        break;
+    }
+}
+
 /**
  * @brief Helper function to get a random position
  *
@@ -6,103 +6,190 @@
 #include "../include/utils.hpp"
 #include "../include/agents.hpp"
 #include "../include/config.hpp"
-
-void run_sim(std::vector<Agent *> agents, Position *goal)
+#include "../include/runtime_config.hpp"
+#include "../include/simulation.hpp"
+#include "../include/population.hpp"
+#include "../include/island.hpp"
+#include "../include/renderer.hpp"
+#include "../include/checkpoint.hpp"
+#include "../include/telemetry.hpp"
+#include "../include/trace.hpp"
+
+int main(int argc, char **argv)
 {
-    for (int tick = 0; tick < NUM_TICKS_PER_GEN; tick++)
+    // Everything below reads its settings from 'config'
+    if (!config.parse_args(argc, argv))
+        return 1;
+
+    // Replaying a trace starts from the seed it was recorded with, unless another one is given
+    if (config.verify_trace && config.seed == 0 && !ReplayTrace::read_seed(config.trace_path.c_str(), config.seed))
     {
-        for (Agent *a : agents)
-        {
-            // Sense the Agents distance from the goal
-            float sensors[2] = {
-                (a->positions.back()->x - goal->x) / BOUNDARY_EDGE_LENGTH,
-                (a->positions.back()->y - goal->y) / BOUNDARY_EDGE_LENGTH};
-            // Ask the Agent what it wants to do
-            a->move(sensors);
-        }
+        std::cerr << "Could not read the seed from the trace at " << config.trace_path << std::endl;
+        return 1;
     }
-}
+    if (config.seed == 0)
+        config.seed = time(0);
+    generator.seed(config.seed);
 
-std::vector<Agent *> *setup_agent_generation(Position *start_pos = NULL, std::vector<AgentDistancePair *> *based_on = NULL, MergeType mt = SingleSplit, float mutation_chance = 0.01)
-{
-    // Storage for our agents
-    std::vector<Agent *> *agents = new std::vector<Agent *>;
-
-    for (int agent_i = 0; agent_i < NUM_AGENTS_PER_GEN; agent_i++)
+    // Traces are only comparable when thread timing can't change the results
+    ReplayTrace *trace = NULL;
+    if (!config.trace_path.empty())
     {
+        config.deterministic = true;
+        trace = new ReplayTrace(config.num_islands, config.num_gen);
+    }
 
-        // Check if we are basing our agents on anything
-        if (based_on)
+    // Goal Location
+    Position *new_pos = get_random_position(config.boundary_edge_length - 1, config.boundary_edge_length - 1);
+    Position *goal = get_random_position(config.boundary_edge_length - 1, config.boundary_edge_length - 1);
+
+    // Every island shares the goal so migrants can be ranked against the locals, only the first one is drawn
+    std::vector<Island *> islands;
+    for (int island_i = 0; island_i < config.num_islands; island_i++)
+        islands.push_back(new Island(*new_pos, *goal, island_i == 0));
+
+    // Pick up where an earlier run left off, the checkpoint's selected agents become the parents of our first generation.
+    // This happens before any worker, thread or checkpoint writer is started, so a resume that can't go ahead exits
+    // without touching the checkpoint
+    int first_generation = 0;
+    if (config.resume_from_checkpoint)
+    {
+        const char *path = config.checkpoint_path.c_str();
+        Checkpoint checkpoint;
+        if (!checkpoint.load(path))
         {
-            int choice1 = get_rand_int(0, based_on->size() - 1), choice2 = get_rand_int(0, based_on->size() - 1);
-            while (choice2 == choice1)
-                choice2 = get_rand_int(0, based_on->size() - 1);
-            // Using default mutation delta
-            agents->push_back(new Agent(new Position(start_pos->x, start_pos->y), based_on->at(choice1)->agent, based_on->at(choice2)->agent, mt, mutation_chance));
+            std::cerr << "Could not resume, the checkpoint at " << path << " is missing, truncated or from another version" << std::endl;
+            return 1;
         }
-        else
+        Island &island = *islands[0];
+        if (!checkpoint.matches(island.population.current()[0]->nn))
         {
-            // Create agents with two sensors, distance from goal x and y
-            agents->push_back(new Agent(new Position(start_pos->x, start_pos->y), 2));
+            std::cerr << "Could not resume, the checkpoint at " << path << " was saved with a different network topology" << std::endl;
+            return 1;
         }
+        const CheckpointHeader *header = checkpoint.header;
+        if (header->num_agents > config.num_agents_per_gen)
+        {
+            std::cerr << "Could not resume, the checkpoint at " << path << " holds " << header->num_agents << " agents, more than the "
+                      << config.num_agents_per_gen << " in a generation" << std::endl;
+            return 1;
+        }
+
+        first_generation = header->generation + 1;
+        memcpy(generator.state, header->rng_state, sizeof(generator.state));
+        island.place(Position(header->start_x, header->start_y), Position(header->goal_x, header->goal_y));
+        island.mutation_chance = header->mutation_chance;
+        for (int agent_i = 0; agent_i < header->num_agents; agent_i++)
+        {
+            Agent *agent = island.population.current()[agent_i];
+            island.closest.push_back(AgentDistancePair(agent, checkpoint.restore_agent(agent_i, agent)));
+        }
+        std::cout << "Resuming from generation " << first_generation << std::endl;
     }
 
-    return agents;
-}
+    // Workers are forked before any other thread is started
+    ProcessPool *workers = NULL;
+    if (config.num_worker_processes > 0)
+    {
+        workers = new ProcessPool(config.num_worker_processes, islands[0]->population.current()[0], config.num_agents_per_gen, config.worker_use_tcp, config.num_scenarios);
+        islands[0]->workers = workers;
+        if (config.draw_generation_performance)
+            std::cout << "Drawing is not available with worker processes, only final positions come back" << std::endl;
+        config.draw_generation_performance = false;
+    }
 
-int main()
-{
-    generator.seed(time(0));
-    std::vector<AgentDistancePair *> *closest = NULL;
-    std::vector<Agent *> *agents = NULL;
+    // The viewer runs on its own thread so drawing never holds up evolution
+    Renderer *renderer = NULL;
+    if (config.draw_generation_performance)
+        renderer = new Renderer(config.num_agents_per_gen, config.num_ticks_per_gen + 1);
 
-    // Goal Location
-    Position *new_pos = get_random_position(BOUNDARY_EDGE_LENGTH - 1, BOUNDARY_EDGE_LENGTH - 1);
-    Position *goal = get_random_position(BOUNDARY_EDGE_LENGTH - 1, BOUNDARY_EDGE_LENGTH - 1);
+    if (islands.size() > 1)
+    {
+        if (config.checkpoint_every_n_generations > 0)
+            std::cout << "Checkpoints are not written in island mode" << std::endl;
 
-    float max_distance = get_distance(Position(0, 0), Position(BOUNDARY_EDGE_LENGTH, BOUNDARY_EDGE_LENGTH));
+        evolve_islands(islands, generator, renderer, trace);
+    }
+    else
+    {
+        Island &island = *islands[0];
+        ThreadPool pool(config.num_threads);
 
-    float mutation_chance = 0;
-    float dist_perc = 0.10;
+        int checkpoint_every = config.checkpoint_every_n_generations;
+        CheckpointWriter *checkpoint_writer = NULL;
+        if (checkpoint_every > 0)
+            checkpoint_writer = new CheckpointWriter(config.checkpoint_path.c_str());
 
-    for (int generation = 0; generation < NUM_GEN; generation++)
-    {
-        // Setup our generations Agents
-        if (!closest)
+        TELEMETRY_ONLY(TelemetryWriter telemetry(config.telemetry_path, allocation_count);)
+
+        // Each generation is reported on its own thread while the next one evolves
+        GenerationReporter *reporter = new GenerationReporter(renderer, checkpoint_writer, trace);
+        TELEMETRY_ONLY(reporter->telemetry = &telemetry;)
+
+        for (int generation = first_generation; generation < config.num_gen; generation++)
         {
-            // Setup our initial set of agents
-            agents = setup_agent_generation(new_pos);
+            uint64_t allocations_before_generation = allocation_count();
+
+            // Breed, run and rank our generation
+            island.evolve(generation, pool);
+
+            {
+                TELEMETRY_PHASE(PhaseCleanup);
+                GenerationReport &report = reporter->begin_report(island, generation);
+                report.checkpoint = checkpoint_writer && (generation + 1) % checkpoint_every == 0;
+                report.allocations = allocation_count() - allocations_before_generation;
+            }
+            reporter->submit();
         }
-        else
+
+        // Finishes the last report, which may still be queueing a checkpoint
+        delete reporter;
+        // Waits for the last checkpoint to hit the disk
+        delete checkpoint_writer;
+    }
+
+    if (config.weight_precision != WeightsFloat32 && config.num_gen > 0)
+    {
+        // Rerun the drawn island's last generation at full precision to see what quantizing cost
+        ThreadPool pool(config.num_threads);
+        FitnessDrift drift = measure_fitness_drift(islands[0]->population.current(), islands[0]->scenarios, pool, config.num_agents_selected_each_generation, config.fitness_reduction);
+        std::cout << "Quantized fitness drift against float32: mean " << drift.mean << ", max " << drift.max << ", " << drift.selected_kept << " of the "
+                  << config.num_agents_selected_each_generation << " best agents unchanged" << std::endl;
+    }
+
+    if (config.fitness_cache_size > 0 && config.num_sensed_neighbours == 0)
+    {
+        uint64_t hits = 0, misses = 0;
+        for (Island *island : islands)
         {
-            // Distance Percentage, approaches 0 as the best performing agent gets closer to the goal
-            dist_perc = (*closest).at(0)->distance / max_distance;
-            // Base our mutation chance on how close we are to the goal.
-            mutation_chance = std::min(MUTATION_CHANCE_C_VALUE * pow(2, (dist_perc * MUTATION_CHANCE_LIMIT)), MAX_MUTATION_CHANCE);
-            // Setup our next generation
-            std::vector<Agent *> *new_agents = setup_agent_generation(new_pos, closest, AGENT_MERGE_STRATEGY, mutation_chance);
-
-            // Clean up our previous generation
-            for (int a = 0; a < agents->size(); a++)
-                delete (*agents)[a];
-            for (int adp = 0; adp < closest->size(); adp++)
-                delete (*closest)[adp];
-
-            delete agents;
-            delete closest;
-
-            agents = new_agents;
+            hits += island->cache.hits;
+            misses += island->cache.total_misses;
         }
+        std::cout << "Fitness cache hits: " << hits << ", misses: " << misses << std::endl;
+    }
 
-        // Run our simulation
-        run_sim(*agents, goal);
+    int exit_code = 0;
+    if (trace)
+    {
+        if (config.verify_trace)
+            exit_code = trace->verify(config.trace_path.c_str()) ? 0 : 1;
+        else if (!trace->save(config.trace_path.c_str(), config.seed))
+        {
+            std::cerr << "Could not write the trace to " << config.trace_path << std::endl;
+            exit_code = 1;
+        }
+        delete trace;
+    }
 
-        // Rank our agents and take the configured number of top performers
-        closest = get_closest_agents(*agents, goal, generation, NUM_AGENTS_SELECTED_EACH_GENERATION);
+    for (Island *island : islands)
+        delete island;
+    delete workers;
 
-        if (PRINT_GENERATION_PERFORMANCE)
-            std::cout << closest->at(0)->distance << "," << mutation_chance << std::endl;
+    if (renderer)
+    {
+        renderer->finish();
+        delete renderer;
     }
 
-    return 0;
-}
\ No newline at end of file
+    return exit_code;
+}
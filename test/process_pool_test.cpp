@@ -0,0 +1,95 @@
+#include <chrono>
+#include <iostream>
+#include <signal.h>
+#include <vector>
+#include "../include/utils.hpp"
+#include "../include/agents.hpp"
+#include "../include/runtime_config.hpp"
+#include "../include/scenario.hpp"
+#include "../include/simulation.hpp"
+#include "../include/process_pool.hpp"
+
+/**
+ * @brief Run a generation through the worker processes and check every agent ends up where it did in this process
+ *
+ * @param workers
+ * @param agents
+ * @param scenarios
+ * @param expected Every agent's final position, from evaluating the generation in this process
+ * @param seconds Set to how long the generation took
+ * @return true
+ * @return false An agent ended up somewhere else
+ */
+bool run_and_compare(ProcessPool &workers, std::vector<Agent *> &agents, const std::vector<Scenario> &scenarios, const std::vector<Position> &expected, double &seconds)
+{
+    for (Agent *agent : agents)
+        agent->reset(scenarios[0].start, EndpointsOnly);
+    PopulationNetwork network;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    workers.run_sim(agents, scenarios, network);
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (size_t agent_i = 0; agent_i < agents.size(); agent_i++)
+    {
+        Position final_pos = agents[agent_i]->scenario_position(0);
+        if (final_pos.x != expected[agent_i].x || final_pos.y != expected[agent_i].y)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Stop a worker with SIGSTOP, so it stays alive but never replies, and check the master times out on it and
+ * evaluates its slice itself. Run over Unix sockets and over TCP.
+ */
+int main()
+{
+    config.num_agents_per_gen = 20;
+    config.num_ticks_per_gen = 100;
+    config.worker_timeout_seconds = 1;
+    generator.seed(1);
+
+    std::vector<Agent *> agents;
+    for (int agent_i = 0; agent_i < config.num_agents_per_gen; agent_i++)
+        agents.push_back(new Agent(Position(100, 100), config.num_sensors()));
+    std::vector<Scenario> scenarios = make_scenarios(Position(100, 100), Position(600, 500), 1, config.boundary_edge_length);
+
+    // Where every agent should end up, evaluated in this process
+    PopulationNetwork network;
+    if (config.use_batched_inference)
+        shape_population(network, agents, scenarios.size());
+    for (Agent *agent : agents)
+        agent->reset(scenarios[0].start, EndpointsOnly);
+    run_sim_range(agents, 0, agents.size(), scenarios, network);
+    std::vector<Position> expected;
+    for (Agent *agent : agents)
+        expected.push_back(agent->scenario_position(0));
+
+    int failures = 0;
+    for (bool use_tcp : {false, true})
+    {
+        const char *transport = use_tcp ? "tcp" : "unix";
+        ProcessPool workers(2, agents[0], agents.size(), use_tcp);
+        double seconds = 0;
+        if (workers.live_workers() != 2 || !run_and_compare(workers, agents, scenarios, expected, seconds))
+        {
+            std::cout << transport << ": healthy workers gave the wrong results" << std::endl;
+            failures++;
+            continue;
+        }
+
+        kill(workers.worker_pid(0), SIGSTOP);
+        bool matched = run_and_compare(workers, agents, scenarios, expected, seconds);
+        if (!matched || workers.live_workers() != 1 || seconds > config.worker_timeout_seconds + 5)
+        {
+            std::cout << transport << ": stopped worker not handled, " << workers.live_workers() << " live workers after " << seconds << "s" << std::endl;
+            failures++;
+            continue;
+        }
+        std::cout << transport << ": stopped worker dropped after " << seconds << "s" << std::endl;
+    }
+
+    for (Agent *agent : agents)
+        delete agent;
+    return failures == 0 ? 0 : 1;
+}